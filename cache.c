@@ -0,0 +1,121 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+#define CACHE_LINE_LEN 512
+
+/* Write path of cache file `name` to `path`. If `create` is true then directory of cache is
+ * created.
+ */
+bool cache_path(const char *name, char *path, bool create)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int len;
+
+	if (base && *base)
+		len = snprintf(path, PATH_MAX, "%s/spi-flasher", base);
+	else if (home && *home)
+		len = snprintf(path, PATH_MAX, "%s/.cache/spi-flasher", home);
+	else
+		return false;
+
+	if (len >= PATH_MAX)
+		return false;
+
+	if (create) {
+		// parent directory (~/.cache) can be absent too
+		for (char *p = path + 1; *p; p++) {
+			if (*p != '/')
+				continue;
+
+			*p = '\0';
+			if (mkdir(path, S_IRWXU) && errno != EEXIST)
+				return false;
+			*p = '/';
+		}
+		if (mkdir(path, S_IRWXU) && errno != EEXIST)
+			return false;
+	}
+
+	return snprintf(path + len, PATH_MAX - len, "/%s", name) < PATH_MAX - len;
+}
+
+/* Find value of `key` in cache `name`. Return false if it is not found.
+ */
+bool cache_get(const char *name, const char *key, char *value, size_t len)
+{
+	char path[PATH_MAX];
+	char line[CACHE_LINE_LEN];
+	size_t key_len = strlen(key);
+	bool found = false;
+	FILE *f;
+
+	if (!cache_path(name, path, false))
+		return false;
+
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+
+	while (!found && fgets(line, sizeof(line), f)) {
+		if (strncmp(line, key, key_len) || line[key_len] != ' ')
+			continue;
+
+		line[strcspn(line, "\n")] = '\0';
+		snprintf(value, len, "%s", line + key_len + 1);
+		found = true;
+	}
+	fclose(f);
+
+	return found;
+}
+
+/* Store `value` of `key` in cache `name`, previous value of the key is replaced. File is
+ * replaced atomically, so other running instance reads old or new cache.
+ */
+bool cache_set(const char *name, const char *key, const char *value)
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 8];
+	char line[CACHE_LINE_LEN];
+	size_t key_len = strlen(key);
+	FILE *f;
+	FILE *tmp;
+	bool res;
+
+	if (!cache_path(name, path, true))
+		return false;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	tmp = fdopen(mkstemp(tmp_path), "w");
+	if (!tmp)
+		return false;
+
+	f = fopen(path, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (!strncmp(line, key, key_len) && line[key_len] == ' ')
+				continue;
+
+			fputs(line, tmp);
+		}
+		fclose(f);
+	}
+	fprintf(tmp, "%s %s\n", key, value);
+
+	res = !fclose(tmp);
+	if (res)
+		res = !rename(tmp_path, path);
+	if (!res)
+		unlink(tmp_path);
+
+	return res;
+}
@@ -0,0 +1,16 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Persistent key-value storage of results that are expensive to get, e.g. tuned speed of
+ * converter with connected flash. Every cache is text file in $XDG_CACHE_HOME/spi-flasher (or
+ * ~/.cache/spi-flasher), one "key value" pair per line. Keys must not contain spaces.
+ */
+bool cache_path(const char *name, char *path, bool create);
+bool cache_get(const char *name, const char *key, char *value, size_t len);
+bool cache_set(const char *name, const char *key, const char *value);
+
+#endif
@@ -0,0 +1,185 @@
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "content.h"
+#include "hash.h"
+
+#define CONTENT_MAGIC	0x43495053  // "SPIC"
+#define CONTENT_MAX_AGE	(24 * 3600) // seconds, data of chip can be changed by its board later
+
+// header of cache file, followed by hashes of sectors
+struct content_header {
+	uint32_t magic;
+	uint32_t size;        // size of flash
+	uint32_t sector;      // CONTENT_SECTOR
+	uint32_t reserved;
+	uint64_t time;        // time of last save
+	uint8_t ids[16];      // ID of flash
+	uint64_t checksum;    // hash of all previous fields and of hashes of sectors
+};
+
+
+static uint64_t content_checksum(struct content_header *hdr, uint64_t *hashes, uint32_t count)
+{
+	uint64_t hash = hash_update(HASH_INIT, (uint8_t *)hdr,
+				    offsetof(struct content_header, checksum));
+
+	return hash_update(hash, (uint8_t *)hashes, count * sizeof(*hashes));
+}
+
+/* Read hashes from cache file. Return false if file is absent, damaged or is not usable for flash.
+ */
+static bool content_load(struct content *content)
+{
+	struct content_header hdr;
+	char path[PATH_MAX];
+	uint64_t now = time(NULL);
+	size_t len = content->count * sizeof(*content->hashes);
+	bool res;
+	FILE *f;
+
+	if (!cache_path(content->name, path, false))
+		return false;
+
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+
+	res = fread(&hdr, sizeof(hdr), 1, f) == 1 && hdr.magic == CONTENT_MAGIC &&
+	      hdr.size == content->size && hdr.sector == CONTENT_SECTOR &&
+	      !memcmp(hdr.ids, content->ids, sizeof(hdr.ids)) && hdr.time <= now &&
+	      now - hdr.time <= CONTENT_MAX_AGE &&
+	      fread(content->hashes, len, 1, f) == 1 &&
+	      hdr.checksum == content_checksum(&hdr, content->hashes, content->count);
+	fclose(f);
+
+	return res;
+}
+
+/* Open cache of chip with unique ID `uid`. Data of all sectors is unknown if cache is not found.
+ * Return false if chip has no unique ID or memory can not be allocated, then cache is not used
+ * and other functions do nothing.
+ */
+bool content_open(struct content *content, const uint8_t *uid, unsigned uid_len,
+		  const uint8_t *ids, uint32_t size)
+{
+	int len;
+
+	memset(content, 0, sizeof(*content));
+	if (!uid_len || !size)
+		return false;
+
+	len = snprintf(content->name, sizeof(content->name), "content-");
+	for (unsigned i = 0; i < uid_len && len + 2 < sizeof(content->name); i++)
+		len += snprintf(content->name + len, sizeof(content->name) - len, "%02x", uid[i]);
+
+	memcpy(content->ids, ids, sizeof(content->ids));
+	content->size = size;
+	content->count = (size + CONTENT_SECTOR - 1) / CONTENT_SECTOR;
+	content->hashes = (uint64_t *)malloc(content->count * sizeof(*content->hashes));
+	if (!content->hashes)
+		return false;
+
+	if (!content_load(content))
+		content_invalidate(content, 0, size);
+
+	return true;
+}
+
+/* Return hash of data of one sector.
+ */
+uint64_t content_hash(const uint8_t *data)
+{
+	uint64_t hash = hash_update(HASH_INIT, data, CONTENT_SECTOR);
+
+	return hash == CONTENT_UNKNOWN ? hash + 1 : hash;
+}
+
+/* Mark all sectors touched by region as unknown.
+ */
+void content_invalidate(struct content *content, uint32_t offset, uint32_t len)
+{
+	uint64_t end = min((uint64_t)offset + len, content->size);
+
+	if (!content->hashes || !len)
+		return;
+
+	for (uint32_t i = offset / CONTENT_SECTOR; i < (end + CONTENT_SECTOR - 1) / CONTENT_SECTOR;
+	     i++)
+		content->hashes[i] = CONTENT_UNKNOWN;
+}
+
+/* Store hashes of data written to region. If `data` is NULL then region is erased. Data of
+ * sectors partially covered by region is not known, they are marked as unknown.
+ */
+void content_update(struct content *content, uint32_t offset, const uint8_t *data, uint32_t len)
+{
+	static uint8_t blank[CONTENT_SECTOR];
+	uint64_t end = min((uint64_t)offset + len, content->size);
+	uint32_t first = (offset + CONTENT_SECTOR - 1) / CONTENT_SECTOR;
+
+	if (!content->hashes)
+		return;
+
+	if (!data)
+		memset(blank, 0xff, sizeof(blank));
+
+	content_invalidate(content, offset, len);
+	for (uint32_t i = first; i < end / CONTENT_SECTOR; i++) {
+		const uint8_t *sector = data ? data + i * CONTENT_SECTOR - offset : blank;
+
+		content->hashes[i] = content_hash(sector);
+	}
+}
+
+/* Write cache to disk. File is replaced atomically. If it can not be written, then old file is
+ * removed, because it can describe data that is changed now.
+ */
+bool content_save(struct content *content)
+{
+	struct content_header hdr = { 0 };
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 8];
+	size_t len = content->count * sizeof(*content->hashes);
+	bool res;
+	FILE *tmp;
+
+	if (!content->hashes || !cache_path(content->name, path, true))
+		return false;
+
+	hdr.magic = CONTENT_MAGIC;
+	hdr.size = content->size;
+	hdr.sector = CONTENT_SECTOR;
+	hdr.time = time(NULL);
+	memcpy(hdr.ids, content->ids, sizeof(hdr.ids));
+	hdr.checksum = content_checksum(&hdr, content->hashes, content->count);
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	tmp = fdopen(mkstemp(tmp_path), "w");
+	res = tmp && fwrite(&hdr, sizeof(hdr), 1, tmp) == 1 &&
+	      fwrite(content->hashes, len, 1, tmp) == 1;
+	if (tmp)
+		res = !fclose(tmp) && res;
+	if (res)
+		res = !rename(tmp_path, path);
+	if (!res) {
+		unlink(tmp_path);
+		unlink(path);
+	}
+
+	return res;
+}
+
+void content_close(struct content *content)
+{
+	free(content->hashes);
+	content->hashes = NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef _CONTENT_H
+#define _CONTENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define CONTENT_SECTOR  (4 * KiB)  // size of region with one hash
+#define CONTENT_UNKNOWN 0          // hash of sector with unknown data
+
+/*
+ * Hashes of data of flash by sectors as it was written or read by spi-flasher last time. Hashes
+ * are kept per chip with unique ID in cache directory (see cache.h), so data of chip can be known
+ * without reading it. Cache is not used if ID or size of flash differ or if it is older than
+ * CONTENT_MAX_AGE.
+ */
+struct content {
+	char name[48];      // name of cache file
+	uint8_t ids[16];    // ID of flash
+	uint32_t size;      // size of flash
+	uint32_t count;     // count of sectors
+	uint64_t *hashes;   // NULL if chip has no cache
+};
+
+bool content_open(struct content *content, const uint8_t *uid, unsigned uid_len,
+		  const uint8_t *ids, uint32_t size);
+uint64_t content_hash(const uint8_t *data);
+void content_invalidate(struct content *content, uint32_t offset, uint32_t len);
+void content_update(struct content *content, uint32_t offset, const uint8_t *data, uint32_t len);
+bool content_save(struct content *content);
+void content_close(struct content *content);
+
+#endif
@@ -0,0 +1,635 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ch341a.h"
+#include "common.h"
+#include "emul.h"
+#include "hash.h"
+#include "spi.h"
+#include "usb.h"
+
+// Timings of emulated hardware in nanoseconds
+#define EMUL_USB_LATENCY	500000  // scheduling of one transfer by host and device
+#define EMUL_USB_BYTE		1000    // full speed bulk transfer of one byte
+#define EMUL_SPI_BYTE		5300    // SPI clock about 1.5 MHz at speed 0, doubled by every step
+#define EMUL_SPEED_UNSTABLE	3       // long leads of fixture corrupt MISO from this speed
+#define EMUL_ERROR_RATE		65536   // one of this count of bytes is corrupted at unstable speed
+#define EMUL_T_PP		700000
+#define EMUL_T_SE_4K		45000000
+#define EMUL_T_SE_32K		120000000
+#define EMUL_T_SE_64K		150000000
+#define EMUL_T_CE_MIB		2500000000ULL  // chip erase of every MiB
+
+#define EMUL_PAGE		256
+#define EMUL_SFDP_SIZE		0x80
+#define EMUL_SFDP_BFPT		0x30    // address of basic flash parameter table
+#define EMUL_SFDP_ADDR4		0x70    // address of 4-byte address instruction table
+#define EMUL_STATUS_WIP		BIT(0)
+#define EMUL_STATUS_WEL		BIT(1)
+
+#define EMUL_CMD_READ_ID	0x9f
+#define EMUL_CMD_READ_STATUS	0x5
+#define EMUL_CMD_READ_UID	0x4b
+#define EMUL_CMD_READ_SFDP	0x5a
+#define EMUL_CMD_READ		0x3
+#define EMUL_CMD_FAST_READ	0xb
+#define EMUL_CMD_READ_4BYTE	0x13
+#define EMUL_CMD_FAST_READ_4BYTE 0xc
+#define EMUL_CMD_WRITE_ENABLE	0x6
+#define EMUL_CMD_WRITE_DISABLE	0x4
+#define EMUL_CMD_PAGE_PROGRAM	0x2
+#define EMUL_CMD_PAGE_PROGRAM_4BYTE 0x12
+#define EMUL_CMD_ERASE_SECTOR	0xd8
+#define EMUL_CMD_ERASE_SECTOR_4BYTE 0xdc
+#define EMUL_CMD_ERASE_4KSECTOR	0x20
+#define EMUL_CMD_ERASE_4KSECTOR_4BYTE 0x21
+#define EMUL_CMD_ERASE_32KBLOCK	0x52
+#define EMUL_CMD_ERASE_32KBLOCK_4BYTE 0x5c
+#define EMUL_CMD_ERASE_CHIP	0xc7
+#define EMUL_CMD_ERASE_CHIP_2	0x60
+
+struct emul_nor {
+	int fd;
+	uint8_t *mem;
+	uint32_t size;
+	uint8_t ids[3];
+	uint8_t uid[8];
+	uint8_t sfdp[EMUL_SFDP_SIZE];
+	bool selected;
+	uint8_t cmd;
+	unsigned pos;       // count of bytes received after CS was asserted
+	uint32_t addr;
+	bool wel;
+	uint64_t busy_until;
+	uint8_t page[EMUL_PAGE];
+};
+
+struct emul {
+	struct emul_nor nor[SPI_CS_COUNT];
+	int nor_count;
+	uint8_t *fifo;      // data to send to host by IN transfers
+	unsigned fifo_head;
+	unsigned fifo_len;
+	unsigned fifo_size;
+	uint64_t delay;     // time of USB and SPI activity to emulate on next sleep
+	int packets;        // count of IN packets (one per SPI stream command)
+	unsigned speed;     // clock setting from I2C stream command
+	unsigned seed;      // state of generator of errors at unstable speed
+};
+
+static uint64_t emul_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void emul_sleep(struct emul *emul)
+{
+	struct timespec ts = {
+		.tv_sec = emul->delay / 1000000000,
+		.tv_nsec = emul->delay % 1000000000,
+	};
+
+	nanosleep(&ts, NULL);
+	emul->delay = 0;
+}
+
+static uint8_t emul_swap(uint8_t c)
+{
+	c = (c & 0xf0) >> 4 | (c & 0x0f) << 4;
+	c = (c & 0xcc) >> 2 | (c & 0x33) << 2;
+
+	return (c & 0xaa) >> 1 | (c & 0x55) << 1;
+}
+
+static bool emul_fifo_push(struct emul *emul, uint8_t c)
+{
+	if (emul->fifo_head + emul->fifo_len == emul->fifo_size) {
+		if (emul->fifo_head) {
+			memmove(emul->fifo, emul->fifo + emul->fifo_head, emul->fifo_len);
+			emul->fifo_head = 0;
+		} else {
+			uint8_t *fifo = (uint8_t *)realloc(emul->fifo, emul->fifo_size * 2);
+
+			if (!fifo)
+				return false;
+
+			emul->fifo = fifo;
+			emul->fifo_size *= 2;
+		}
+	}
+	emul->fifo[emul->fifo_head + emul->fifo_len++] = c;
+
+	return true;
+}
+
+static bool emul_nor_busy(struct emul_nor *nor, uint64_t now)
+{
+	return nor->busy_until > now;
+}
+
+static unsigned emul_nor_addr_len(uint8_t cmd)
+{
+	switch (cmd) {
+	case EMUL_CMD_READ:
+	case EMUL_CMD_FAST_READ:
+	case EMUL_CMD_READ_SFDP:
+	case EMUL_CMD_PAGE_PROGRAM:
+	case EMUL_CMD_ERASE_SECTOR:
+	case EMUL_CMD_ERASE_4KSECTOR:
+	case EMUL_CMD_ERASE_32KBLOCK:
+		return 3;
+	case EMUL_CMD_READ_4BYTE:
+	case EMUL_CMD_FAST_READ_4BYTE:
+	case EMUL_CMD_PAGE_PROGRAM_4BYTE:
+	case EMUL_CMD_ERASE_SECTOR_4BYTE:
+	case EMUL_CMD_ERASE_4KSECTOR_4BYTE:
+	case EMUL_CMD_ERASE_32KBLOCK_4BYTE:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static uint8_t emul_nor_status(struct emul_nor *nor, uint64_t now)
+{
+	if (emul_nor_busy(nor, now))
+		return EMUL_STATUS_WIP | EMUL_STATUS_WEL;
+
+	return nor->wel ? EMUL_STATUS_WEL : 0;
+}
+
+/* Clock one byte at time `now` while CS is asserted. Return byte from MISO line.
+ */
+static uint8_t emul_nor_xfer(struct emul_nor *nor, uint8_t mosi, uint64_t now)
+{
+	unsigned pos = nor->pos++;
+	unsigned addr_len;
+
+	if (!pos) {
+		// while flash is busy it accepts only status reading
+		if (emul_nor_busy(nor, now) && mosi != EMUL_CMD_READ_STATUS)
+			mosi = 0;
+
+		nor->cmd = mosi;
+		nor->addr = 0;
+		if (mosi == EMUL_CMD_PAGE_PROGRAM || mosi == EMUL_CMD_PAGE_PROGRAM_4BYTE)
+			memset(nor->page, 0xff, sizeof(nor->page));
+
+		return 0xff;
+	}
+
+	addr_len = emul_nor_addr_len(nor->cmd);
+	if (pos <= addr_len) {
+		nor->addr = (nor->addr << 8) | mosi;
+		return 0xff;
+	}
+	pos -= addr_len + 1;  // position of data byte
+
+	switch (nor->cmd) {
+	case EMUL_CMD_READ_ID:
+		return pos < sizeof(nor->ids) ? nor->ids[pos] : 0;
+	case EMUL_CMD_READ_UID:
+		// 4 dummy bytes before unique ID
+		return pos >= 4 && pos < 4 + sizeof(nor->uid) ? nor->uid[pos - 4] : 0xff;
+	case EMUL_CMD_READ_STATUS:
+		return emul_nor_status(nor, now);
+	case EMUL_CMD_READ_SFDP:
+		if (!pos)
+			return 0xff;  // dummy byte
+
+		return nor->addr + pos - 1 < sizeof(nor->sfdp) ? nor->sfdp[nor->addr + pos - 1] : 0xff;
+	case EMUL_CMD_FAST_READ:
+	case EMUL_CMD_FAST_READ_4BYTE:
+		if (!pos)
+			return 0xff;  // dummy byte
+
+		return nor->mem[(nor->addr + pos - 1) & (nor->size - 1)];
+	case EMUL_CMD_READ:
+	case EMUL_CMD_READ_4BYTE:
+		return nor->mem[(nor->addr + pos) & (nor->size - 1)];
+	case EMUL_CMD_PAGE_PROGRAM:
+	case EMUL_CMD_PAGE_PROGRAM_4BYTE:
+		// address wraps to start of the page
+		nor->page[(nor->addr + pos) & (EMUL_PAGE - 1)] &= mosi;
+		return 0xff;
+	default:
+		return 0xff;
+	}
+}
+
+static void emul_nor_erase(struct emul_nor *nor, uint32_t size, uint64_t now, uint64_t time)
+{
+	uint32_t addr = nor->addr & (nor->size - 1) & ~(size - 1);
+
+	memset(nor->mem + addr, 0xff, size);
+	nor->busy_until = now + time;
+	nor->wel = false;
+}
+
+/* CS is deasserted at time `now`: execute received command.
+ */
+static void emul_nor_deselect(struct emul_nor *nor, uint64_t now)
+{
+	bool addr_done = nor->pos > emul_nor_addr_len(nor->cmd);
+
+	if (!nor->pos)
+		return;
+
+	switch (nor->cmd) {
+	case EMUL_CMD_WRITE_ENABLE:
+		nor->wel = true;
+		break;
+	case EMUL_CMD_WRITE_DISABLE:
+		nor->wel = false;
+		break;
+	case EMUL_CMD_PAGE_PROGRAM:
+	case EMUL_CMD_PAGE_PROGRAM_4BYTE:
+		if (nor->wel && addr_done) {
+			uint8_t *page = nor->mem + (nor->addr & (nor->size - 1) & ~(EMUL_PAGE - 1));
+
+			for (int i = 0; i < EMUL_PAGE; i++)
+				page[i] &= nor->page[i];
+
+			nor->busy_until = now + EMUL_T_PP;
+			nor->wel = false;
+		}
+		break;
+	case EMUL_CMD_ERASE_SECTOR:
+	case EMUL_CMD_ERASE_SECTOR_4BYTE:
+		if (nor->wel && addr_done)
+			emul_nor_erase(nor, 64 * KiB, now, EMUL_T_SE_64K);
+		break;
+	case EMUL_CMD_ERASE_4KSECTOR:
+	case EMUL_CMD_ERASE_4KSECTOR_4BYTE:
+		if (nor->wel && addr_done)
+			emul_nor_erase(nor, 4 * KiB, now, EMUL_T_SE_4K);
+		break;
+	case EMUL_CMD_ERASE_32KBLOCK:
+	case EMUL_CMD_ERASE_32KBLOCK_4BYTE:
+		if (nor->wel && addr_done)
+			emul_nor_erase(nor, 32 * KiB, now, EMUL_T_SE_32K);
+		break;
+	case EMUL_CMD_ERASE_CHIP:
+	case EMUL_CMD_ERASE_CHIP_2:
+		if (nor->wel)
+			emul_nor_erase(nor, nor->size, now, EMUL_T_CE_MIB * nor->size / MiB);
+		break;
+	default:
+		break;
+	}
+	nor->pos = 0;
+}
+
+static void emul_uio_stream(struct emul *emul, uint8_t *data, int len)
+{
+	for (int i = 0; i < len; i++) {
+		if (data[i] == CH341A_CMD_UIO_STM_END)
+			break;
+
+		switch (data[i] & 0xc0) {
+		case CH341A_CMD_UIO_STM_OUT:
+			// D0-D2 are CS of flashes, active low
+			for (int n = 0; n < emul->nor_count; n++) {
+				struct emul_nor *nor = &emul->nor[n];
+				bool selected = !(data[i] & BIT(n));
+
+				if (nor->selected && !selected)
+					emul_nor_deselect(nor, emul_now() + emul->delay);
+				else if (!nor->selected && selected)
+					nor->pos = 0;
+
+				nor->selected = selected;
+			}
+			break;
+		case CH341A_CMD_UIO_STM_US:
+			emul->delay += (data[i] & 0x3f) * 1000;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Commands are processed before sleep for their time, so time of every byte is counted from
+ * time of processing and activity that is not slept yet.
+ */
+static bool emul_spi_stream(struct emul *emul, uint8_t *data, int len)
+{
+	uint64_t now = emul_now() + emul->delay;
+
+	for (int i = 0; i < len; i++) {
+		uint8_t miso = 0xff;
+
+		now += EMUL_SPI_BYTE >> emul->speed;
+		// MISO is pulled up, so selected chips drive it together
+		for (int n = 0; n < emul->nor_count; n++) {
+			if (emul->nor[n].selected)
+				miso &= emul_nor_xfer(&emul->nor[n], emul_swap(data[i]), now);
+		}
+
+		if (emul->speed >= EMUL_SPEED_UNSTABLE && !(rand_r(&emul->seed) % EMUL_ERROR_RATE))
+			miso ^= BIT(rand_r(&emul->seed) % 8);
+
+		if (!emul_fifo_push(emul, emul_swap(miso)))
+			return false;
+	}
+	emul->delay += len * (EMUL_SPI_BYTE >> emul->speed);
+
+	return true;
+}
+
+/* Process one OUT transfer. Every USB packet starts from command of CH341A, only the last packet
+ * of transfer can be short.
+ */
+static bool emul_transfer(struct emul *emul, uint8_t *data, int len)
+{
+	emul->delay += len * EMUL_USB_BYTE;
+	for (int pos = 0; pos < len; pos += CH341_PACKET_LENGTH) {
+		int packet_len = min(len - pos, CH341_PACKET_LENGTH);
+
+		switch (data[pos]) {
+		case CH341A_CMD_I2C_STREAM:
+			if (packet_len > 1 &&
+			    (data[pos + 1] & 0xe0) == CH341A_CMD_I2C_STM_SET)
+				emul->speed = data[pos + 1] & 0x3;
+			break;
+		case CH341A_CMD_UIO_STREAM:
+			emul_uio_stream(emul, data + pos + 1, packet_len - 1);
+			break;
+		case CH341A_CMD_SPI_STREAM:
+			if (!emul_spi_stream(emul, data + pos + 1, packet_len - 1))
+				return false;
+			emul->packets++;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return true;
+}
+
+static bool emul_write(struct usb_device *device, void *buf, int len)
+{
+	struct emul *emul = (struct emul *)device->priv;
+	bool res;
+
+	emul->delay += EMUL_USB_LATENCY;
+	res = emul_transfer(emul, (uint8_t *)buf, len);
+	emul_sleep(emul);
+
+	return res;
+}
+
+static bool emul_read(struct usb_device *device, void *buf, int len)
+{
+	struct emul *emul = (struct emul *)device->priv;
+
+	if (len > emul->fifo_len)
+		return false;
+
+	memcpy(buf, emul->fifo + emul->fifo_head, len);
+	emul->fifo_head += len;
+	emul->fifo_len -= len;
+	if (!emul->fifo_len)
+		emul->fifo_head = 0;
+
+	emul->delay += EMUL_USB_LATENCY + len * EMUL_USB_BYTE;
+	emul_sleep(emul);
+
+	return true;
+}
+
+/* Transfers are pipelined by host, so latency is paid once for whole stream.
+ */
+static bool emul_stream(struct usb_device *device, uint8_t *buf_out, const int *lens_out,
+			int count_out, uint8_t *buf_in, const int *lens_in, int count_in)
+{
+	struct emul *emul = (struct emul *)device->priv;
+	bool res = true;
+	int len_in = 0;
+
+	for (int i = 0; i < count_in; i++)
+		len_in += lens_in[i];
+
+	// transfers are queued, so latency of USB is paid once
+	emul->delay += EMUL_USB_LATENCY;
+	emul->packets = 0;
+	for (int i = 0; i < count_out && res; i++) {
+		res = emul_transfer(emul, buf_out, lens_out[i]);
+		buf_out += lens_out[i];
+	}
+	emul_sleep(emul);
+
+	// real device would not complete IN transfers if count of packets is not expected
+	if (!res || len_in > emul->fifo_len || emul->packets != count_in)
+		return false;
+
+	memcpy(buf_in, emul->fifo + emul->fifo_head, len_in);
+	emul->fifo_head += len_in;
+	emul->fifo_len -= len_in;
+	if (!emul->fifo_len)
+		emul->fifo_head = 0;
+
+	return true;
+}
+
+static void emul_nor_close(struct emul_nor *nor)
+{
+	if (nor->mem)
+		munmap(nor->mem, nor->size);
+	if (nor->fd > 0)
+		close(nor->fd);
+}
+
+static void emul_close(struct usb_device *device)
+{
+	struct emul *emul = (struct emul *)device->priv;
+
+	for (int i = 0; i < emul->nor_count; i++)
+		emul_nor_close(&emul->nor[i]);
+
+	free(emul->fifo);
+	free(emul);
+	device->priv = NULL;
+}
+
+/* Emulated flash answers to READ_ID as Winbond W25Q with size code in third byte. Unique ID is
+ * made from inode of image, so it is kept when image is changed by other program.
+ */
+static void emul_fill_ids(struct emul_nor *nor, struct stat *stat)
+{
+	uint64_t uid = hash_update(HASH_INIT, (uint8_t *)&stat->st_ino, sizeof(stat->st_ino));
+	uint8_t id2 = __builtin_ctz(nor->size);
+
+	if (id2 > 0x19)
+		id2 += 6;
+
+	nor->ids[0] = 0xef;
+	nor->ids[1] = 0x40;
+	nor->ids[2] = id2;
+	for (int i = 0; i < sizeof(nor->uid); i++)
+		nor->uid[i] = uid >> (i * 8);
+}
+
+static void emul_put_le32(uint8_t *buf, uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		buf[i] = value >> (i * 8);
+}
+
+/* Typical time `ns` of SFDP as count of units, unit is index of `units_ns`. Time is encoded in
+ * bits 4:0 (count minus one) and 6:5 (unit).
+ */
+static uint32_t emul_sfdp_time(uint64_t ns, const uint64_t *units_ns)
+{
+	int unit = 0;
+	uint64_t count;
+
+	while (unit < 3 && (ns + units_ns[unit] - 1) / units_ns[unit] > 32)
+		unit++;
+	count = (ns + units_ns[unit] / 2) / units_ns[unit];
+	if (count > 32)
+		count = 32;
+
+	return (count ? count - 1 : 0) | unit << 5;
+}
+
+/* SFDP of JESD216B with basic flash parameter table and 4-byte address instruction table.
+ */
+static void emul_fill_sfdp(struct emul_nor *nor)
+{
+	static const uint64_t erase_units[] = { 1000000, 16000000, 128000000, 1000000000 };
+	static const uint64_t chip_units[] = {
+		16000000, 256000000, 4000000000ULL, 64000000000ULL
+	};
+	uint8_t *bfpt = nor->sfdp + EMUL_SFDP_BFPT;
+	uint32_t addr_mode = nor->size > 16 * MiB ? 1 : 0;  // 3-byte only or 3- and 4-byte
+	uint64_t bits = (uint64_t)nor->size * 8;
+
+	memset(nor->sfdp, 0xff, sizeof(nor->sfdp));
+	// header with 2 parameter headers, revision 1.6
+	emul_put_le32(nor->sfdp, 0x50444653);
+	emul_put_le32(nor->sfdp + 4, 0xff010106);
+	emul_put_le32(nor->sfdp + 8, 0x10010600);
+	emul_put_le32(nor->sfdp + 12, 0xff000000 | EMUL_SFDP_BFPT);
+	emul_put_le32(nor->sfdp + 16, 0x02010084);
+	emul_put_le32(nor->sfdp + 20, 0xff000000 | EMUL_SFDP_ADDR4);
+
+	memset(bfpt, 0, 16 * 4);
+	// uniform 4 KiB erase by 0x20
+	emul_put_le32(bfpt, 0xff800000 | addr_mode << 17 | EMUL_CMD_ERASE_4KSECTOR << 8 | 0x5);
+	emul_put_le32(bfpt + 4, bits <= BIT(31) ? bits - 1 : BIT(31) | __builtin_ctzll(bits));
+	// erase types: 4 KiB, 32 KiB and 64 KiB
+	emul_put_le32(bfpt + 28, EMUL_CMD_ERASE_32KBLOCK << 24 | 15 << 16 |
+		      EMUL_CMD_ERASE_4KSECTOR << 8 | 12);
+	emul_put_le32(bfpt + 32, EMUL_CMD_ERASE_SECTOR << 8 | 16);
+	emul_put_le32(bfpt + 36, emul_sfdp_time(EMUL_T_SE_4K, erase_units) << 4 |
+		      emul_sfdp_time(EMUL_T_SE_32K, erase_units) << 11 |
+		      emul_sfdp_time(EMUL_T_SE_64K, erase_units) << 18 | 1);
+	// page of 256 bytes, program time in units of 64 us
+	emul_put_le32(bfpt + 40, emul_sfdp_time(EMUL_T_CE_MIB * (nor->size / KiB) / KiB,
+						chip_units) << 24 |
+		      BIT(13) | ((EMUL_T_PP + 32000) / 64000 - 1) << 8 | 8 << 4 | 1);
+
+	// 0x13, 0x0c and 0x12 commands, erase types 1-3 by 0x21, 0x5c and 0xdc
+	emul_put_le32(nor->sfdp + EMUL_SFDP_ADDR4, BIT(0) | BIT(1) | BIT(6) | BIT(9) | BIT(10) |
+		      BIT(11));
+	emul_put_le32(nor->sfdp + EMUL_SFDP_ADDR4 + 4, 0xff000000 |
+		      EMUL_CMD_ERASE_SECTOR_4BYTE << 16 | EMUL_CMD_ERASE_32KBLOCK_4BYTE << 8 |
+		      EMUL_CMD_ERASE_4KSECTOR_4BYTE);
+}
+
+static bool emul_nor_open(struct emul_nor *nor, const char *path)
+{
+	struct stat stat;
+
+	nor->fd = open(path, O_RDWR);
+	if (nor->fd == -1 || fstat(nor->fd, &stat))
+		return false;
+
+	// size of flash must be power of two
+	if (stat.st_size < 64 * KiB || stat.st_size > 2LL * GiB ||
+	    (stat.st_size & (stat.st_size - 1)))
+		return false;
+
+	nor->size = stat.st_size;
+	nor->mem = (uint8_t *)mmap(NULL, nor->size, PROT_READ | PROT_WRITE, MAP_SHARED, nor->fd, 0);
+	if (nor->mem == MAP_FAILED) {
+		nor->mem = NULL;
+		return false;
+	}
+	emul_fill_ids(nor, &stat);
+	emul_fill_sfdp(nor);
+
+	return true;
+}
+
+/* device->path is image file of flash. Up to SPI_CS_COUNT images separated by '+' can be
+ * specified, then flashes are connected to CS0, CS1 and CS2.
+ */
+static bool emul_open(struct usb_device *device)
+{
+	struct emul *emul;
+	char *paths;
+	char *path;
+	char *saveptr;
+
+	if (!device->path)
+		return false;
+
+	emul = (struct emul *)calloc(1, sizeof(*emul));
+	if (!emul)
+		return false;
+
+	emul->fifo_size = CH341_MAX_PACKET_LEN;
+	emul->fifo = (uint8_t *)malloc(emul->fifo_size);
+	paths = strdup(device->path);
+	if (!emul->fifo || !paths)
+		goto err;
+
+	for (path = strtok_r(paths, "+", &saveptr); path; path = strtok_r(NULL, "+", &saveptr)) {
+		if (emul->nor_count == SPI_CS_COUNT)
+			goto err;
+
+		if (!emul_nor_open(&emul->nor[emul->nor_count++], path))
+			goto err;
+	}
+	if (!emul->nor_count)
+		goto err;
+
+	free(paths);
+	device->priv = emul;
+	snprintf(device->serial, sizeof(device->serial), "emul:%s", device->path);
+
+	return true;
+
+err:
+	for (int i = 0; i < emul->nor_count; i++)
+		emul_nor_close(&emul->nor[i]);
+	free(paths);
+	free(emul->fifo);
+	free(emul);
+
+	return false;
+}
+
+const struct usb_ops emul_ops = {
+	.open = emul_open,
+	.close = emul_close,
+	.read = emul_read,
+	.write = emul_write,
+	.stream = emul_stream,
+};
@@ -0,0 +1,14 @@
+#ifndef _EMUL_H
+#define _EMUL_H
+
+#include "usb.h"
+
+/*
+ * Software CH341A converter with SPI NOR flash connected to it. Memory of flash is the image
+ * file specified in usb_device.path, its size is the size of the flash.
+ * Emulated converter is connected to flash by long leads: the fastest speed setting sometimes
+ * corrupts read data.
+ */
+extern const struct usb_ops emul_ops;
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+/* FNV-1a 64-bit hash. To hash data by parts pass result of previous call as `hash`, for the first
+ * part pass HASH_INIT.
+ */
+static inline uint64_t hash_update(uint64_t hash, const uint8_t *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+#endif
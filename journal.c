@@ -0,0 +1,101 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "hash.h"
+#include "journal.h"
+
+#define JOURNAL_MAGIC	0x4a495053  // "SPIJ"
+
+
+static uint64_t journal_checksum(struct journal_record *rec)
+{
+	return hash_update(HASH_INIT, (uint8_t *)rec, offsetof(struct journal_record, checksum));
+}
+
+/* Open (or create) journal `name` in cache directory. Return false if journal can not be
+ * created.
+ */
+bool journal_open(struct journal *journal, const char *name)
+{
+	char path[PATH_MAX];
+
+	memset(journal, 0, sizeof(*journal));
+	if (!cache_path(name, path, true))
+		return false;
+
+	journal->path = strdup(path);
+	if (!journal->path)
+		return false;
+
+	journal->fd = open(journal->path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	if (journal->fd == -1) {
+		free(journal->path);
+		journal->path = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/* Read record of interrupted operation. Return false if journal is empty or damaged.
+ */
+bool journal_load(struct journal *journal)
+{
+	struct journal_record rec;
+
+	if (pread(journal->fd, &rec, sizeof(rec), 0) != sizeof(rec))
+		return false;
+
+	if (rec.magic != JOURNAL_MAGIC || rec.checksum != journal_checksum(&rec))
+		return false;
+
+	journal->rec = rec;
+
+	return true;
+}
+
+/* Write record to disk. Record is on disk when function returns.
+ */
+bool journal_commit(struct journal *journal)
+{
+	journal->rec.magic = JOURNAL_MAGIC;
+	journal->rec.checksum = journal_checksum(&journal->rec);
+	if (pwrite(journal->fd, &journal->rec, sizeof(journal->rec), 0) != sizeof(journal->rec))
+		return false;
+
+	return !fdatasync(journal->fd);
+}
+
+/* Delete journal `name` if it exists, e.g. when flash is changed without journal.
+ */
+void journal_remove(const char *name)
+{
+	char path[PATH_MAX];
+
+	if (cache_path(name, path, false))
+		unlink(path);
+}
+
+/* Close journal. If `remove` is true then operation is completed and journal is deleted.
+ */
+void journal_close(struct journal *journal, bool remove)
+{
+	if (!journal->path)
+		return;
+
+	close(journal->fd);
+	if (remove)
+		unlink(journal->path);
+
+	free(journal->path);
+	journal->path = NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum journal_op {
+	JOURNAL_NONE,
+	JOURNAL_READ,
+	JOURNAL_FLASH,
+};
+
+// state of interrupted operation, stored on disk
+struct journal_record {
+	uint32_t magic;
+	uint32_t op;           // enum journal_op
+	uint8_t ids[16];       // ID of flash
+	uint64_t image_hash;   // hash of data to flash or of device and inode of read file
+	uint32_t offset;
+	uint32_t size;
+	uint32_t erase_block;
+	uint32_t erased;       // bytes from `offset` that were erased
+	uint32_t done;         // bytes from `offset` that were flashed or read and saved
+	uint32_t reserved;
+	uint64_t checksum;     // hash of all previous fields
+};
+
+struct journal {
+	char *path;
+	int fd;
+	struct journal_record rec;
+};
+
+bool journal_open(struct journal *journal, const char *name);
+bool journal_load(struct journal *journal);
+bool journal_commit(struct journal *journal);
+void journal_close(struct journal *journal, bool remove);
+void journal_remove(const char *name);
+
+#endif
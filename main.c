@@ -3,18 +3,36 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <locale.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "common.h"
+#include "content.h"
+#include "emul.h"
+#include "hash.h"
+#include "journal.h"
+#include "mismatch.h"
 #include "spi.h"
 #include "spi-nor.h"
 #include "usb.h"
 
 #define PROGRESS_WIDTH 16
+#define JOURNAL_CHUNK  (1 * MiB)  // granularity of journal for read command
+#define JOURNAL_SYNC   (4 * MiB)  // read data is synced and committed to journal by such parts
+#define JOURNAL_NAME_LEN 32       // "journal-" and hash of converter and chip
+#define STATION_POLL_MS 200       // period of checking of board in station mode
+#define AUTOTUNE_SIZE  (64 * KiB) // default size of region read by autotune
+#define AUTOTUNE_READS 8          // count of reads of region at every speed
+#define SPEED_CACHE    "speed"    // cache of tuned speeds
+#define DELTA_CHUNK    (1 * MiB)  // flash is read and compared with image by such parts
+#define SPOT_CHECKS    4          // default count of sectors read to check content cache
 
 #define FLAG_REQUIRE_SIZE        BIT(0)
 #define FLAG_REQUIRE_ERASE_BLOCK BIT(1)
@@ -27,6 +45,8 @@ enum command {
 	COMMAND_FLASH,
 	COMMAND_ERASE,
 	COMMAND_CUSTOM,
+	COMMAND_STATION,
+	COMMAND_AUTOTUNE,
 	COMMAND_UNKNOWN  // must be last
 };
 
@@ -52,10 +72,33 @@ struct arg {
 	uint32_t flash_size;
 	uint32_t flash_eraseblock;
 	uint32_t flash_page;
+	uint32_t queue_depth;
+	int speed;  // -1 if not specified
+	char **devices;
+	int devices_count;
+	uint8_t cs[SPI_CS_COUNT];
+	int cs_count;
 	struct command_op *command_op;
+	bool emulate;
+	bool gang;
 	bool custom_duplex;
 	bool hide_progress;
 	bool verify;
+	bool resume;
+	bool plan;
+	bool skip_blank;
+	bool delta;
+	int cached;  // count of sectors read to check content cache, -1 if cache is not used
+	char *report;  // file for map of differences found by verification, NULL if not used
+};
+
+// state of station mode
+struct station {
+	struct usb_monitor monitor;
+	struct usb_device dev;
+	char path[USB_PATH_LEN];  // location of current converter, empty if it is disconnected
+	bool opened;
+	int next_image;           // index of next board in emulation
 };
 
 struct multiplier {
@@ -63,9 +106,47 @@ struct multiplier {
 	long mul;
 };
 
+// device served by one thread in gang mode
+struct gang_worker {
+	pthread_t thread;
+	struct usb_device dev;
+	struct spi_flash flash;
+	struct arg arg;
+	const char *status;
+	double time;
+	uint32_t pos;
+	uint32_t size;
+	uint32_t last_percent;
+};
+
 cb_progress progress;
 uint32_t progress_last_points = (uint32_t)-1;
 
+static struct gang_worker *gang_workers;
+static int gang_count;
+static pthread_mutex_t gang_lock = PTHREAD_MUTEX_INITIALIZER;
+// worker of current thread, NULL if gang mode is not used
+static __thread struct gang_worker *gang_self;
+
+// progress of one part of operation is shown as progress of whole operation
+static uint32_t progress_chunk_base;
+static uint32_t progress_chunk_total;
+
+/* Print information message. Workers of gang mode do not print messages, their results are
+ * shown by result table.
+ */
+static void info(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (gang_self)
+		return;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
 static void print_utf8(uint32_t c)
 {
 	uint8_t buf[4];
@@ -132,8 +213,42 @@ void progress_ascii(uint32_t pos, uint32_t size)
 	_progress(pos, size, &progress_symbol, 1);
 }
 
+/* Show progress of all devices of gang in one line.
+ */
+void progress_gang(uint32_t pos, uint32_t size)
+{
+	uint32_t percent;
+
+	if (!size)
+		return;
+
+	percent = (uint64_t)pos * 100 / size;
+
+	pthread_mutex_lock(&gang_lock);
+	gang_self->pos = pos;
+	gang_self->size = size;
+	if (percent != gang_self->last_percent) {
+		gang_self->last_percent = percent;
+		putchar('\r');
+		for (int i = 0; i < gang_count; i++) {
+			struct gang_worker *worker = &gang_workers[i];
+
+			percent = worker->size ? (uint64_t)worker->pos * 100 / worker->size : 0;
+			printf("%s:%3u%% ", worker->dev.path, worker->status ? 100 : percent);
+		}
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&gang_lock);
+}
+
 void progress_close(void)
 {
+	// line of gang progress is shared by all devices
+	if (gang_self) {
+		gang_self->last_percent = (uint32_t)-1;
+		return;
+	}
+
 	printf("\r%18s\r", "");
 	fflush(stdout);
 	progress_last_points = (uint32_t)-1;
@@ -196,49 +311,389 @@ bool parse_size(char *s, uint32_t *value)
 	return true;
 }
 
+/* Progress callback for operation that is divided into parts. Position of current part must be
+ * stored in `progress_chunk_base`.
+ */
+static void progress_chunk(uint32_t pos, uint32_t size)
+{
+	progress(progress_chunk_base + pos, progress_chunk_total);
+}
+
+/* Journal is used only with --resume and only for regular file: position in pipe or device can
+ * not be restored, and hash of image and sync of journal are not free.
+ */
+static bool journal_allowed(struct arg *arg, int fd)
+{
+	struct stat stat;
+
+	return arg->resume && !fstat(fd, &stat) && S_ISREG(stat.st_mode);
+}
+
+/* Write name of journal of chip to `name`. Journal belongs to converter and chip, so processes
+ * with other converters do not share it. Chip without unique ID is known by its ID only.
+ */
+static void journal_name(struct usb_device *dev, struct spi_flash *flash, char *name)
+{
+	uint64_t hash = hash_update(HASH_INIT, (uint8_t *)dev->serial, strlen(dev->serial));
+
+	hash = hash_update(hash, &flash->cs, sizeof(flash->cs));
+	if (flash->uid_len)
+		hash = hash_update(hash, flash->uid, flash->uid_len);
+	else
+		hash = hash_update(hash, flash->ids, sizeof(flash->ids));
+	snprintf(name, JOURNAL_NAME_LEN, "journal-%016llx", (unsigned long long)hash);
+}
+
+/* Delete journal of chip, its progress is not valid after flash is changed without journal.
+ */
+static void journal_drop(struct usb_device *dev, struct spi_flash *flash)
+{
+	char name[JOURNAL_NAME_LEN];
+
+	journal_name(dev, flash, name);
+	journal_remove(name);
+}
+
+/* Open journal of chip. `rec` describes operation, if journal of interrupted operation matches
+ * it, then progress (`erased` and `done`) is taken from journal. Return false if journal can not
+ * be used, operation is run without journal in this case.
+ */
+static bool journal_begin(struct journal *journal, struct usb_device *dev,
+			  struct spi_flash *flash, struct journal_record *rec)
+{
+	char name[JOURNAL_NAME_LEN];
+	bool loaded;
+
+	journal_name(dev, flash, name);
+	if (!journal_open(journal, name)) {
+		error(0, errno, "WARNING: failed to create journal, operation can not be resumed");
+		return false;
+	}
+
+	loaded = journal_load(journal);
+	if (loaded && journal->rec.op == rec->op &&
+	    !memcmp(journal->rec.ids, rec->ids, sizeof(rec->ids)) &&
+	    journal->rec.image_hash == rec->image_hash && journal->rec.offset == rec->offset &&
+	    journal->rec.size == rec->size && journal->rec.erase_block == rec->erase_block) {
+		rec->erased = journal->rec.erased;
+		rec->done = journal->rec.done;
+	} else if (loaded) {
+		info("Journal does not match this operation, starting from beginning\n");
+	}
+
+	journal->rec = *rec;
+	if (!journal_commit(journal)) {
+		error(0, errno, "WARNING: failed to write journal, operation can not be resumed");
+		journal_close(journal, true);
+		return false;
+	}
+
+	return true;
+}
+
+/* Check data of flash at `offset` after resume. If `fd` is -1, then memory must be erased, else
+ * memory must be equal to file at position `file_pos`.
+ */
+static bool journal_check(struct usb_device *dev, struct spi_flash *flash, int fd,
+			  uint32_t offset, uint32_t file_pos, uint32_t len)
+{
+	uint8_t *buf = (uint8_t *)malloc(len * 2);
+	bool res;
+
+	if (!buf)
+		return false;
+
+	res = spi_nor_read(dev, flash, offset, len, buf, 0, NULL);
+	if (res) {
+		if (fd == -1) {
+			for (uint32_t i = 0; i < len && res; i++)
+				res = buf[i] == 0xff;
+		} else {
+			res = pread(fd, buf + len, len, file_pos) == len && !memcmp(buf, buf + len, len);
+		}
+	}
+	free(buf);
+
+	return res;
+}
+
+/* Read flash to regular file by chunks through one writer, data is synced and committed to
+ * journal after every JOURNAL_SYNC bytes.
+ */
+static bool read_by_chunks(struct usb_device *dev, struct spi_flash *flash, struct arg *arg,
+			   int fd, struct journal *journal)
+{
+	struct journal_record *rec = &journal->rec;
+	struct writer writer;
+	struct stat stat;
+	bool res = true;
+
+	if (rec->done) {
+		uint32_t pos = (rec->done - 1) / JOURNAL_CHUNK * JOURNAL_CHUNK;
+
+		// output file can be changed after interrupt, check last saved chunk only
+		if (fstat(fd, &stat) || stat.st_size < rec->done)
+			rec->done = 0;
+		else if (!journal_check(dev, flash, fd, arg->offset + pos, pos, rec->done - pos))
+			rec->done = pos;
+		info("Resuming read from offset %u...\n", arg->offset + rec->done);
+	}
+
+	if (lseek(fd, rec->done, SEEK_SET) == (off_t)-1 ||
+	    !writer_open(&writer, fd, arg->size - rec->done))
+		return false;
+
+	progress_chunk_total = arg->size;
+	while (res && rec->done < arg->size) {
+		uint32_t len = min(arg->size - rec->done, JOURNAL_SYNC);
+
+		progress_chunk_base = rec->done;
+		res = spi_nor_read_to(dev, flash, arg->offset + rec->done, len, &writer,
+				      progress ? progress_chunk : NULL) &&
+		      writer_sync(&writer);
+		if (res) {
+			rec->done += len;
+			res = journal_commit(journal);
+		}
+	}
+	res = writer_close(&writer, res) && res;
+
+	return res && !ftruncate(fd, arg->size);
+}
+
 static bool do_read(struct usb_device *dev, struct spi_flash *flash, struct arg *arg)
 {
+	struct journal journal = { 0 };
+	struct journal_record rec = { 0 };
+	struct stat stat;
+	bool use_journal = false;
 	int fd;
 	bool res;
 
+	// mapping of output needs reading, regular file is truncated below unless read is resumed
 	if (!strcmp(arg->args[0], "-"))
 		fd = STDOUT_FILENO;
 	else
-		fd = open(arg->args[0], O_CREAT | O_WRONLY | O_TRUNC,
+		fd = open(arg->args[0], O_CREAT | O_RDWR,
 			  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
 
-	if (fd == -1) {
+	if (fd == -1 || fstat(fd, &stat)) {
 		error(0, errno, "ERROR: failed to open file '%s'", arg->args[0]);
+		if (fd != -1 && fd != STDOUT_FILENO)
+			close(fd);
+		return false;
+	}
+	if (journal_allowed(arg, fd)) {
+		rec.op = JOURNAL_READ;
+		memcpy(rec.ids, flash->ids, sizeof(rec.ids));
+		// other file must not continue interrupted read
+		rec.image_hash = hash_update(HASH_INIT, (uint8_t *)&stat.st_dev, sizeof(stat.st_dev));
+		rec.image_hash = hash_update(rec.image_hash, (uint8_t *)&stat.st_ino,
+					     sizeof(stat.st_ino));
+		rec.offset = arg->offset;
+		rec.size = arg->size;
+		use_journal = journal_begin(&journal, dev, flash, &rec);
+	}
+	// data of interrupted read is kept and its last chunk is checked
+	if (fd != STDOUT_FILENO && S_ISREG(stat.st_mode) && !(use_journal && journal.rec.done) &&
+	    ftruncate(fd, 0)) {
+		error(0, errno, "ERROR: failed to truncate file '%s'", arg->args[0]);
+		journal_close(&journal, false);
+		close(fd);
 		return false;
 	}
 	if (fd != STDOUT_FILENO)
-		printf("Reading %u bytes from offset %u...\n", arg->size, arg->offset);
-	res = spi_nor_read(dev, flash, arg->offset, arg->size, NULL, fd, progress);
+		info("Reading %u bytes from offset %u...\n", arg->size, arg->offset);
+	if (use_journal)
+		res = read_by_chunks(dev, flash, arg, fd, &journal);
+	else
+		res = spi_nor_read(dev, flash, arg->offset, arg->size, NULL, fd, progress);
 	if (progress)
 		progress_close();
 
 	if ((fd != STDOUT_FILENO && close(fd)) || !res) {
 		error(0, errno, "ERROR: failed read or save data");
+		if (use_journal)
+			info("Read can be continued with --resume option\n");
+		journal_close(&journal, false);
 		return false;
 	}
+	journal_close(&journal, true);
 	if (fd != STDOUT_FILENO)
-		printf("Read completed\n");
+		info("Read completed\n");
+
+	return true;
+}
+
+/* Print count of pages and erases skipped because they are blank or unchanged and average count
+ * of status reads per page program and per erase done after previous call.
+ * show_cs - prefix lines with chip select of flash.
+ */
+static void print_stats(struct spi_flash *flash, bool show_cs)
+{
+	struct spi_nor_poll *program = &flash->poll_program;
+	bool found = program->ops;
+
+	if (flash->blank_pages || flash->blank_erases) {
+		if (show_cs)
+			info("CS%u: ", flash->cs);
+		info("Skipped blank: %u pages, %u erases\n", flash->blank_pages,
+		     flash->blank_erases);
+		flash->blank_pages = flash->blank_erases = 0;
+	}
+	if (flash->same_pages || flash->kept_blocks) {
+		if (show_cs)
+			info("CS%u: ", flash->cs);
+		info("Delta: %u pages unchanged, %u erase blocks without erase\n",
+		     flash->same_pages, flash->kept_blocks);
+		flash->same_pages = flash->kept_blocks = 0;
+	}
+
+	for (int i = 0; i <= SPI_NOR_ERASE_CHIP; i++)
+		found = found || spi_nor_get_erase_type(flash, i)->poll.ops;
+
+	if (!found)
+		return;
+
+	if (show_cs)
+		info("CS%u: ", flash->cs);
+
+	info("Status polls:");
+	if (program->ops)
+		info(" %.1f per page program (%u)", (double)program->polls / program->ops,
+		     program->ops);
+	for (int i = 0; i <= SPI_NOR_ERASE_CHIP; i++) {
+		struct spi_nor_poll *erase = &spi_nor_get_erase_type(flash, i)->poll;
+
+		if (!erase->ops)
+			continue;
+
+		if (i == SPI_NOR_ERASE_CHIP)
+			info(" %.1f per chip erase (%u)", (double)erase->polls / erase->ops,
+			     erase->ops);
+		else
+			info(" %.1f per %uK erase (%u)", (double)erase->polls / erase->ops,
+			     flash->erase_types[i].size / KiB, erase->ops);
+		erase->ops = erase->polls = 0;
+	}
+	info("\n");
+
+	program->ops = program->polls = 0;
+}
+
+/* Go through erase commands chosen for region (see spi_nor_erase_type_at()) and print them if
+ * `print` is set.
+ * Return false if region can not be erased by commands of flash.
+ */
+static bool erase_plan(struct spi_flash *flash, uint32_t offset, uint32_t size, bool print,
+		       unsigned *count)
+{
+	uint32_t unit = flash->erase_types[0].size;
+	uint32_t start, end;
+	uint64_t time_us = 0;
+
+	*count = 0;
+	if (!unit)
+		return false;
+
+	start = offset & ~(unit - 1);
+	end = start + spi_nor_calc_erase_size(flash, offset, size);
+	for (uint32_t addr = start; addr < end; ) {
+		int type = spi_nor_erase_type_at(flash, addr, end);
+		struct spi_nor_erase_type *erase;
+
+		if (type < 0)
+			return false;
+
+		erase = spi_nor_get_erase_type(flash, type);
+		if (print) {
+			info("  0x%08x  cmd 0x%02x  ", addr,
+			     flash->size > 16 * MiB ? erase->cmd4 : erase->cmd3);
+			if (type == SPI_NOR_ERASE_CHIP)
+				info("%s", erase->size == flash->size ? "chip" : "die");
+			else
+				print_size(stdout, erase->size, false);
+			info(" erase, about %u ms\n", erase->poll.expected_us / 1000);
+		}
+		time_us += erase->poll.expected_us;
+		addr += erase->size;
+		(*count)++;
+	}
+
+	if (print) {
+		if (offset != start || offset + size != end)
+			info("%u bytes before and %u bytes after region are kept by read and program\n",
+			     offset - start, end - offset - size);
+		info("%u commands, about %u ms\n", *count, (unsigned)(time_us / 1000));
+	}
 
 	return true;
 }
 
+/* Open content cache of flash and mark region as unknown before it is changed, so interrupted
+ * command does not leave wrong hashes in cache.
+ */
+static void content_begin(struct spi_flash *flash, struct content *content, uint32_t offset,
+			  uint32_t len)
+{
+	if (!content_open(content, flash->uid, flash->uid_len, flash->ids, flash->size))
+		return;
+
+	content_invalidate(content, offset, len);
+	content_save(content);
+}
+
+/* If command succeeded then store hashes of data written to region (`data` is NULL if region is
+ * erased). Close content cache.
+ */
+static void content_end(struct content *content, bool res, uint32_t offset, const uint8_t *data,
+			uint32_t len)
+{
+	if (res) {
+		content_update(content, offset, data, len);
+		content_save(content);
+	}
+	content_close(content);
+}
+
+/* Store hashes of file `fd` flashed to region from `offset` and close content cache.
+ */
+static void content_end_file(struct content *content, int fd, uint32_t offset, uint32_t len)
+{
+	uint8_t buf[64 * KiB];
+
+	for (uint32_t pos = 0; content->hashes && pos < len;) {
+		uint32_t part = min(len - pos, sizeof(buf) - (offset + pos) % sizeof(buf));
+
+		if (pread(fd, buf, part, pos) != part) {
+			content_invalidate(content, offset, len);
+			break;
+		}
+		content_update(content, offset + pos, buf, part);
+		pos += part;
+	}
+	content_save(content);
+	content_close(content);
+}
+
 static bool _erase(struct usb_device *dev, struct spi_flash *flash, uint32_t offset, uint32_t size)
 {
 	uint32_t erase_size;
+	unsigned count;
 	bool res;
 
-	printf("Erasing %u bytes", size);
+	if (!erase_plan(flash, offset, size, false, &count)) {
+		error(0, 0, "ERROR: region can not be erased by erase commands of flash");
+		return false;
+	}
+
+	info("Erasing %u bytes", size);
 	erase_size = spi_nor_calc_erase_size(flash, offset, size);
 	if (erase_size != size)
-		printf(", rounded to %u bytes", erase_size);
+		info(", rounded to %u bytes", erase_size);
 
-	printf(" (%u sectors, starting from %u)...\n",
-		erase_size / flash->erase_block, offset & ~(flash->erase_block - 1));
+	info(" (%u erase commands, starting from %u)...\n",
+		count, offset & ~(flash->erase_types[0].size - 1));
 
 	res = spi_nor_erase_smart(dev, flash, offset, size, progress);
 	if (progress)
@@ -249,193 +704,858 @@ static bool _erase(struct usb_device *dev, struct spi_flash *flash, uint32_t off
 		return false;
 	}
 
-	printf("Erase completed\n");
+	info("Erase completed\n");
+	print_stats(flash, false);
 
 	return true;
 }
 
 static bool do_erase(struct usb_device *dev, struct spi_flash *flash, struct arg *arg)
 {
-	return _erase(dev, flash, arg->offset, arg->size);
-}
-
-/* Compare two files and return count of differences.
- */
-static uint32_t compare_buffers(uint8_t *buf1, uint8_t *buf2, uint32_t len)
-{
-	uint32_t errors = 0;
+	struct content content;
+	unsigned count;
+	bool res;
 
-	for (uint32_t i = 0; i < len; i++) {
-		if (buf1[i] != buf2[i])
-			errors++;
+	if (arg->plan) {
+		info("Erase plan of %u bytes from offset %u:\n", arg->size, arg->offset);
+		if (!erase_plan(flash, arg->offset, arg->size, true, &count)) {
+			error(0, 0, "ERROR: region can not be erased by erase commands of flash");
+			return false;
+		}
+		return true;
 	}
 
-	return errors;
+	content_begin(flash, &content, arg->offset, arg->size);
+	res = _erase(dev, flash, arg->offset, arg->size);
+	content_end(&content, res, arg->offset, NULL, arg->size);
+
+	return res;
 }
 
-/* Compare two files and return count of differences or 0xffffffff in length of file is not equal.
+/* Append map of differences found by verification of `size` bytes of `flash` to file of --report
+ * option. Section of every chip starts with its identification line, `board` is number of board
+ * in station mode or 0.
  */
-static uint32_t compare_files(int fd, int fd_verify)
+static void write_report(struct arg *arg, struct spi_flash *flash, struct mismatch *mismatch,
+			 uint32_t size, uint32_t board)
 {
-	uint8_t buf1[4096];
-	uint8_t buf2[4096];
-	int res1;
-	int res2;
-	uint32_t errors = 0;
-
-	while (1) {
-		res1 = read(fd, buf1, sizeof(buf1));
-		res2 = read(fd_verify, buf2, sizeof(buf2));
-		if (res1 < 0 || res2 < 0 || res1 != res2)
-			return (uint32_t)-1;
+	FILE *f;
 
-		if (!res1)
-			break;
+	if (!arg->report)
+		return;
 
-		errors += compare_buffers(buf1, buf2, res1);
+	// workers of gang mode write to the same file
+	pthread_mutex_lock(&gang_lock);
+	f = fopen(arg->report, "a");
+	if (f) {
+		fprintf(f, "flash\t%s\tCS%u\t", flash->name, flash->cs);
+		for (int i = 0; i < flash->id_len; i++)
+			fprintf(f, "%02x", flash->ids[i]);
+		fprintf(f, "\t");
+		for (int i = 0; i < flash->uid_len; i++)
+			fprintf(f, "%02x", flash->uid[i]);
+		fprintf(f, "%s\n", flash->uid_len ? "" : "-");
+		if (board)
+			fprintf(f, "board\t%u\n", board);
+		if (gang_self)
+			fprintf(f, "device\t%s\n", gang_self->dev.path);
+		fprintf(f, "region\t0x%08x\t%u\n", arg->offset, size);
+		mismatch_print(mismatch, f);
 	}
-
-	return errors;
+	if (!f || fclose(f))
+		error(0, errno, "ERROR: failed to write report '%s'", arg->report);
+	pthread_mutex_unlock(&gang_lock);
 }
 
-/* Return pointer to static variable with unique file name in /tmp directory
+/* Calculate hash of file. File position is restored to start of file.
  */
-static char *get_tmp_fname(void)
+static bool hash_file(int fd, uint64_t *hash)
 {
-	static char fname[32];
-	int i = 0;
+	uint8_t buf[64 * KiB];
+	ssize_t ret;
 
-	do {
-		snprintf(fname, sizeof(fname), "/tmp/spi-flasher%d.tmp", i);
-		i++;
-	} while (!access(fname, F_OK));
+	*hash = HASH_INIT;
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		*hash = hash_update(*hash, buf, ret);
 
-	return fname;
+	return !ret && lseek(fd, 0, SEEK_SET) != (off_t)-1;
 }
 
-static bool do_flash(struct usb_device *dev, struct spi_flash *flash, struct arg *arg)
+/* Return position (from `offset`) of last erase block in range of `done` bytes.
+ */
+static uint32_t last_block(uint32_t offset, uint32_t done, uint32_t erase_block)
 {
-	struct stat stat;
-	uint8_t *verify_buf;
-	uint8_t **ptr_verify_buf = NULL;
-	uint32_t verify_buf_len;
-	uint32_t size;
+	return max(offset, (offset + done - 1) & ~(erase_block - 1)) - offset;
+}
+
+/* Erase and flash file by erase blocks, every finished block is committed to journal. After
+ * resume only last committed block is checked.
+ */
+static bool flash_by_blocks(struct usb_device *dev, struct spi_flash *flash, struct arg *arg,
+			    int fd, uint32_t size, struct journal *journal)
+{
+	struct journal_record *rec = &journal->rec;
+	uint32_t erase_block = flash->erase_block;
 	uint32_t flashed_size;
-	int fd;
-	bool res;
-	bool need_erase;
+	uint32_t pos;
+	bool resume_program = rec->erased >= size && rec->done < size;
+
+	if (rec->erased < size) {
+		if (rec->erased) {
+			pos = last_block(arg->offset, rec->erased, erase_block);
+			if (!journal_check(dev, flash, -1, arg->offset + pos, 0, rec->erased - pos))
+				rec->erased = pos;
+			info("Resuming erase from offset %u\n", arg->offset + rec->erased);
+		}
+		info("Erasing %u bytes...\n", size - rec->erased);
+		progress_chunk_total = size;
+		while (rec->erased < size) {
+			uint32_t addr = arg->offset + rec->erased;
+			uint32_t len = min(size - rec->erased, erase_block - addr % erase_block);
+
+			// whole chip or die is erased by one command if it is faster
+			if (spi_nor_erase_type_at(flash, addr, arg->offset + size) ==
+			    SPI_NOR_ERASE_CHIP)
+				len = flash->erase_chip.size;
+
+			progress_chunk_base = rec->erased;
+			if (!spi_nor_erase_smart(dev, flash, addr, len, progress ? progress_chunk : NULL))
+				return false;
 
-	if (!strcmp(arg->args[0], "-"))
-		fd = STDIN_FILENO;
-	else
-		fd = open(arg->args[0], O_RDONLY);
+			rec->erased += len;
+			if (!journal_commit(journal))
+				return false;
+		}
+		if (progress)
+			progress_close();
+		info("Erase completed\n");
+	} else if (rec->done) {
+		pos = last_block(arg->offset, rec->done, erase_block);
+		if (!journal_check(dev, flash, fd, arg->offset + pos, pos, rec->done - pos))
+			rec->done = pos;
+	}
 
-	if (fd == -1) {
-		error(0, errno, "ERROR: failed to open file '%s'", arg->args[0]);
-		return false;
+	// program of block after last committed one could be started, it must be erased again
+	if (resume_program) {
+		uint32_t addr = arg->offset + rec->done;
+
+		info("Resuming flash from offset %u\n", addr);
+		if (!spi_nor_erase_smart(dev, flash, addr,
+					 min(size - rec->done, erase_block - addr % erase_block), NULL))
+			return false;
 	}
 
-	if (fd != STDIN_FILENO) {
-		if (fstat(fd, &stat)) {
-			error(0, errno, "ERROR: failed to get stat of file");
+	info("Flashing %u bytes from offset %u...\n", size - rec->done, arg->offset + rec->done);
+	if (lseek(fd, rec->done, SEEK_SET) == (off_t)-1)
+		return false;
+
+	while (rec->done < size) {
+		uint32_t addr = arg->offset + rec->done;
+		uint32_t len = min(size - rec->done, erase_block - addr % erase_block);
+
+		progress_chunk_base = rec->done;
+		if (!spi_nor_program_smart(dev, flash, addr, len, &flashed_size, NULL, fd, false,
+					   progress ? progress_chunk : NULL))
 			return false;
-		}
-		size = stat.st_size;
-		need_erase = false;
-		if (!_erase(dev, flash, arg->offset, size))
+
+		// file is changed during flash
+		if (flashed_size != len)
+			return false;
+
+		rec->done += len;
+		if (!journal_commit(journal))
 			return false;
-		printf("Flashing %u bytes from offset %u...\n", size, arg->offset);
-	} else {
-		size = arg->size;
-		need_erase = true;
-		printf("Flashing from offset %u...\n", arg->offset);
-		if (arg->verify)
-			ptr_verify_buf = &verify_buf;
 	}
 
-	res = spi_nor_program_smart(dev, flash, arg->offset, size, &flashed_size, NULL, fd,
-				    need_erase, progress, ptr_verify_buf, &verify_buf_len);
-	if (progress)
-		progress_close();
+	return true;
+}
 
-	if (!res) {
-		error(0, errno, "ERROR: failed flash or read data from file");
-		return false;
-	}
-	printf("Flash completed (%u bytes)\n", flashed_size);
+// state of flash_delta()
+struct delta_state {
+	struct content content;
+	bool cached;          // data of sectors known by content cache is not read
+	uint32_t sectors;     // compared sectors
+	uint32_t erased;      // sectors erased and programmed
+	uint32_t programmed;  // sectors programmed without erase
+	uint32_t known;       // content sectors taken from cache
+	uint32_t flashed;     // programmed bytes
+	uint32_t errors;      // differences found by verification
+};
 
-	if (arg->verify) {
-		char *fname_tmp = get_tmp_fname();
-		uint8_t *buf = NULL;
-		uint32_t errors;
-		int fd_verify = 0;
-
-		printf("Verification...\n");
-		if (fd != STDIN_FILENO) {
-			if (lseek(fd, 0, SEEK_SET) == (off_t)-1) {
-				error(0, errno, "ERROR: failed to lseek file for verify");
-				return false;
-			}
-			fd_verify = open(fname_tmp, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-			if (fd_verify == -1) {
-				error(0, errno, "ERROR: failed to create temporary file %s",
-				      fname_tmp);
-				return false;
-			}
-			verify_buf_len = size;
-		} else {
-			if (verify_buf_len != flashed_size) {
-				error(0, 0, "ERROR: flashed %u bytes, but expected %u",
-				      flashed_size, verify_buf_len);
-				unlink(fname_tmp);
-				return false;
-			}
-			buf = (uint8_t *)malloc(verify_buf_len);
-			if (!buf) {
-				error(0, errno, "ERROR: can not allocate memory");
-				return false;
-			}
-		}
+/* Write `len` bytes of `image` at `addr` over current content of flash `old`. If `erase` is not
+ * set then data only clears bits: region is not erased and only changed pages are programmed.
+ * With --verify region is read back to `old` and checked.
+ */
+static bool flash_delta_run(struct usb_device *dev, struct spi_flash *flash, struct arg *arg,
+			    uint32_t addr, uint32_t len, uint8_t *image, uint8_t *old, bool erase,
+			    struct delta_state *delta)
+{
+	content_invalidate(&delta->content, addr, len);
+	content_save(&delta->content);
 
-		res = spi_nor_read(dev, flash, arg->offset, verify_buf_len, buf, fd_verify, progress);
-		if (progress)
-			progress_close();
-		if (!res) {
-			unlink(fname_tmp);
+	if (erase) {
+		if (!spi_nor_erase_smart(dev, flash, addr, len, NULL) ||
+		    !spi_nor_program_smart(dev, flash, addr, len, NULL, image, 0, false, NULL)) {
+			error(0, errno, "ERROR: failed flash");
 			return false;
 		}
-
-		if (fd != STDIN_FILENO) {
-			if (lseek(fd_verify, 0, SEEK_SET) == (off_t)-1) {
-				error(0, errno, "ERROR: failed to lseek temporary file for verify");
-				unlink(fname_tmp);
-				return false;
+		delta->flashed += len;
+	} else {
+		for (uint32_t pos = 0; pos < len;) {
+			uint32_t page_len = min(len - pos, flash->page - (addr + pos) % flash->page);
+
+			if (memcmp(old + pos, image + pos, page_len)) {
+				if (!spi_nor_program_page_single(dev, flash, addr + pos, image + pos,
+								 page_len)) {
+					error(0, errno, "ERROR: failed flash");
+					return false;
+				}
+				delta->flashed += page_len;
 			}
-			errors = compare_files(fd, fd_verify);
-			close(fd_verify);
-			unlink(fname_tmp);
-		} else {
-			errors = compare_buffers(buf, verify_buf, verify_buf_len);
+			pos += page_len;
 		}
-		if (errors) {
-			error(0, 0, "ERROR: found %u differences", errors);
-			return false;
-		} else
-			printf("Verification completed\n");
 	}
 
-	if (fd != STDIN_FILENO)
-		close(fd);
+	if (arg->verify) {
+		if (!spi_nor_read(dev, flash, addr, len, old, 0, NULL)) {
+			error(0, errno, "ERROR: failed to read flash");
+			return false;
+		}
+		delta->errors += mismatch_compare(flash->mismatch, addr, old, image, len);
+	}
 
 	return true;
 }
 
-static bool do_custom(struct usb_device *dev, struct spi_flash *flash, struct arg *arg)
+/* Read region from `base` to `end` of flash to `data`. Sectors whose hash in content cache is
+ * equal to hash of `image` are not read, they are copied from `image`.
+ */
+static bool flash_delta_read(struct usb_device *dev, struct spi_flash *flash, uint32_t base,
+			     uint32_t end, uint8_t *image, uint8_t *data, struct delta_state *delta)
 {
-	uint8_t *rx_data = (uint8_t *)malloc(arg->data_rx_len);
+	uint32_t run = base;  // start of sectors to read
 
-	if (!rx_data)
-		error(1, errno, "Can not allocate memory");
+	for (uint32_t pos = base; pos < end;) {
+		uint32_t next = min(end, (pos & ~(CONTENT_SECTOR - 1)) + CONTENT_SECTOR);
+
+		if (delta->cached && next - pos == CONTENT_SECTOR &&
+		    delta->content.hashes[pos / CONTENT_SECTOR] == content_hash(image + pos - base)) {
+			if (run < pos &&
+			    !spi_nor_read(dev, flash, run, pos - run, data + run - base, 0, NULL))
+				return false;
+			memcpy(data + pos - base, image + pos - base, CONTENT_SECTOR);
+			delta->known++;
+			run = next;
+		}
+		pos = next;
+	}
+
+	return run == end || spi_nor_read(dev, flash, run, end - run, data + run - base, 0, NULL);
+}
+
+/* Compare region from `base` to `end` of flash with file and write differing sectors. Sectors in
+ * row with the same kind of change (see spi_nor_classify()) are written together.
+ */
+static bool flash_delta_chunk(struct usb_device *dev, struct spi_flash *flash, struct arg *arg,
+			      int fd, uint32_t base, uint32_t end, uint8_t *image, uint8_t *data,
+			      struct delta_state *delta)
+{
+	uint32_t unit = flash->erase_types[0].size;
+	uint32_t errors = delta->errors;
+	enum spi_nor_change run_change = SPI_NOR_SAME;
+	uint32_t run = base;  // start of row of changed sectors, equal to `pos` if there is no row
+	uint32_t pos = base;
+
+	if (pread(fd, image, end - base, base - arg->offset) != end - base) {
+		error(0, errno, "ERROR: failed to read file '%s'", arg->args[0]);
+		return false;
+	}
+	if (!flash_delta_read(dev, flash, base, end, image, data, delta)) {
+		error(0, errno, "ERROR: failed to read flash");
+		return false;
+	}
+
+	while (pos < end) {
+		uint32_t next = min(end, (pos & ~(unit - 1)) + unit);
+		enum spi_nor_change change = spi_nor_classify(data + pos - base, image + pos - base,
+							      next - pos);
+
+		delta->sectors++;
+		delta->erased += change == SPI_NOR_ERASE;
+		delta->programmed += change == SPI_NOR_PROGRAM;
+		if (run < pos && change != run_change) {
+			if (!flash_delta_run(dev, flash, arg, run, pos - run, image + run - base,
+					     data + run - base, run_change == SPI_NOR_ERASE, delta))
+				return false;
+			run = pos;
+		}
+		if (change == SPI_NOR_SAME)
+			run = next;
+		run_change = change;
+		pos = next;
+	}
+
+	if (run < pos && !flash_delta_run(dev, flash, arg, run, pos - run, image + run - base,
+					  data + run - base, run_change == SPI_NOR_ERASE, delta))
+		return false;
+
+	// all sectors of chunk contain data of file now, unless verification failed
+	if (delta->errors == errors)
+		content_update(&delta->content, base, image, end - base);
+
+	return true;
+}
+
+/* Read `count` random sectors of region which are known by content cache and compare them with
+ * cache. If any of them differs, then flash was changed not by spi-flasher and cache is dropped.
+ */
+static bool content_spot_check(struct usb_device *dev, struct spi_flash *flash,
+			       struct content *content, uint32_t offset, uint32_t size, int count,
+			       uint8_t *buf)
+{
+	uint32_t first = (offset + CONTENT_SECTOR - 1) / CONTENT_SECTOR;
+	uint32_t last = (offset + size) / CONTENT_SECTOR;
+	uint32_t *known = (uint32_t *)malloc((last > first ? last - first : 1) * sizeof(*known));
+	uint32_t known_count = 0;
+	bool res = true;
+
+	if (!known) {
+		error(0, errno, "ERROR: can not allocate memory");
+		return false;
+	}
+
+	for (uint32_t i = first; i < last; i++) {
+		if (content->hashes[i] != CONTENT_UNKNOWN)
+			known[known_count++] = i;
+	}
+
+	// random sectors are moved to start of `known`, every sector is checked once
+	srandom(time(NULL) ^ getpid());
+	for (uint32_t i = 0; i < min((uint32_t)count, known_count); i++) {
+		uint32_t j = i + random() % (known_count - i);
+		uint32_t sector = known[j];
+
+		known[j] = known[i];
+		res = spi_nor_read(dev, flash, sector * CONTENT_SECTOR, CONTENT_SECTOR, buf, 0,
+				   NULL);
+		if (!res) {
+			error(0, errno, "ERROR: failed to read flash");
+			break;
+		}
+		if (content_hash(buf) != content->hashes[sector]) {
+			info("Content cache does not match flash at offset %u, cache is dropped\n",
+			     sector * CONTENT_SECTOR);
+			content_invalidate(content, 0, content->size);
+			content_save(content);
+			break;
+		}
+	}
+	free(known);
+
+	return res;
+}
+
+/* Flash only sectors (the smallest erase units) whose data differ from file. Flash is read by
+ * chunks and compared with file. Sectors which differ only by 1 -> 0 bit transitions are
+ * programmed without erase. With --verify only written sectors are read back and checked.
+ * With --cached sectors of content cache with the same data as file are not read.
+ */
+static bool flash_delta(struct usb_device *dev, struct spi_flash *flash, struct arg *arg, int fd,
+			uint32_t size)
+{
+	uint32_t unit = flash->erase_types[0].size;
+	uint32_t chunk = max(DELTA_CHUNK, unit);
+	uint32_t end = arg->offset + size;
+	uint32_t pos = arg->offset;
+	struct delta_state delta = { 0 };
+	uint8_t *image, *data;
+	bool res = true;
+
+	if (!unit) {
+		error(0, 0, "ERROR: unknown erase size of flash");
+		return false;
+	}
+
+	image = (uint8_t *)malloc(chunk);
+	data = usb_buf(dev, USB_BUF_DELTA, chunk);
+	if (!image || !data) {
+		error(0, errno, "ERROR: can not allocate memory");
+		free(image);
+		return false;
+	}
+
+	delta.cached = content_open(&delta.content, flash->uid, flash->uid_len, flash->ids,
+				    flash->size) && arg->cached >= 0;
+	if (delta.cached)
+		res = content_spot_check(dev, flash, &delta.content, arg->offset, size, arg->cached,
+					 data);
+
+	info("Comparing %u bytes from offset %u...\n", size, arg->offset);
+	while (res && pos < end) {
+		uint32_t chunk_end = min(end, (pos & ~(chunk - 1)) + chunk);
+
+		res = flash_delta_chunk(dev, flash, arg, fd, pos, chunk_end, image, data, &delta);
+		if (res && progress)
+			progress(chunk_end - arg->offset, size);
+		pos = chunk_end;
+	}
+	if (progress)
+		progress_close();
+	free(image);
+	if (res)
+		content_save(&delta.content);
+	content_close(&delta.content);
+	if (!res)
+		return false;
+
+	if (delta.known)
+		info("%u sectors are not read, their data is known from content cache\n",
+		     delta.known);
+	info("Flash completed: %u of %u sectors differ (%u without erase), %u bytes flashed\n",
+	     delta.erased + delta.programmed, delta.sectors, delta.programmed, delta.flashed);
+	print_stats(flash, false);
+
+	if (delta.errors) {
+		error(0, 0, "ERROR: found %u differences", delta.errors);
+		return false;
+	}
+	if (arg->verify)
+		info("Verification completed\n");
+
+	return true;
+}
+
+/* Flash data of opened file `fd`, `region` is set to size of flashed region of flash.
+ */
+static bool flash_file(struct usb_device *dev, struct spi_flash *flash, struct arg *arg, int fd,
+		       uint32_t *region)
+{
+	struct stat stat;
+	uint32_t size;
+	uint32_t flashed_size;
+	struct journal journal = { 0 };
+	struct content content;
+	bool use_journal = false;
+	bool res;
+	bool need_erase;
+
+	if (fd != STDIN_FILENO) {
+		if (fstat(fd, &stat)) {
+			error(0, errno, "ERROR: failed to get stat of file");
+			return false;
+		}
+		size = stat.st_size;
+		*region = size;
+		need_erase = false;
+		if (arg->delta) {
+			journal_drop(dev, flash);
+			return flash_delta(dev, flash, arg, fd, size);
+		}
+		if (journal_allowed(arg, fd)) {
+			struct journal_record rec = { 0 };
+
+			rec.op = JOURNAL_FLASH;
+			memcpy(rec.ids, flash->ids, sizeof(rec.ids));
+			rec.offset = arg->offset;
+			rec.size = size;
+			rec.erase_block = flash->erase_block;
+			if (!hash_file(fd, &rec.image_hash)) {
+				error(0, errno, "ERROR: failed to read file '%s'", arg->args[0]);
+				return false;
+			}
+			use_journal = journal_begin(&journal, dev, flash, &rec);
+		} else {
+			journal_drop(dev, flash);
+		}
+		content_begin(flash, &content, arg->offset, size);
+		if (!use_journal) {
+			if (!_erase(dev, flash, arg->offset, size)) {
+				content_close(&content);
+				return false;
+			}
+			info("Flashing %u bytes from offset %u...\n", size, arg->offset);
+		}
+	} else {
+		size = arg->size;
+		need_erase = true;
+		journal_drop(dev, flash);
+		// data from stdin is not kept, so content of region stays unknown
+		content_begin(flash, &content, arg->offset, size);
+		content_close(&content);
+		info("Flashing from offset %u...\n", arg->offset);
+	}
+
+	// every erase block is compared with data right after it is programmed
+	flash->verify = arg->verify;
+	flash->verify_failed = false;
+	if (use_journal) {
+		res = flash_by_blocks(dev, flash, arg, fd, size, &journal);
+		flashed_size = size;
+	} else {
+		res = spi_nor_program_smart(dev, flash, arg->offset, size, &flashed_size, NULL, fd,
+					    need_erase, progress);
+	}
+	flash->verify = false;
+	if (progress)
+		progress_close();
+	if (fd == STDIN_FILENO)
+		*region = flashed_size;
+
+	if (!res) {
+		if (flash->verify_failed)
+			error(0, 0, "ERROR: verification failed at address 0x%x", flash->verify_addr);
+		else
+			error(0, errno, "ERROR: failed flash or read data from file");
+		if (use_journal)
+			info("Flash can be continued with --resume option\n");
+		journal_close(&journal, false);
+		content_close(&content);
+		return false;
+	}
+	journal_close(&journal, true);
+	info("Flash completed (%u bytes)\n", flashed_size);
+	print_stats(flash, false);
+	if (fd != STDIN_FILENO)
+		content_end_file(&content, fd, arg->offset, size);
+
+	if (arg->verify)
+		info("Verification completed\n");
+
+	return true;
+}
+
+/* Flash file, differences found by verification are collected to map of report.
+ */
+static bool do_flash(struct usb_device *dev, struct spi_flash *flash, struct arg *arg)
+{
+	struct mismatch mismatch;
+	uint32_t size = 0;  // region of flash written from file
+	bool res;
+	int fd;
+
+	if (!strcmp(arg->args[0], "-"))
+		fd = STDIN_FILENO;
+	else
+		fd = open(arg->args[0], O_RDONLY);
+
+	if (fd == -1) {
+		error(0, errno, "ERROR: failed to open file '%s'", arg->args[0]);
+		return false;
+	}
+
+	mismatch_init(&mismatch, flash->page);
+	flash->mismatch = &mismatch;
+	res = flash_file(dev, flash, arg, fd, &size);
+	flash->mismatch = NULL;
+	// flash_file() does not close file, so it is closed here on every path
+	if (fd != STDIN_FILENO)
+		close(fd);
+	// flash stops at the first failed erase block, so data after it is not verified
+	if (flash->verify_failed) {
+		uint32_t block_end = (flash->verify_addr & ~(flash->erase_block - 1)) +
+				     flash->erase_block;
+
+		size = min(size, block_end - arg->offset);
+	}
+	// report is not written if verification was not done because of other error
+	if (arg->verify && (res || mismatch.bytes))
+		write_report(arg, flash, &mismatch, size, 0);
+	mismatch_free(&mismatch);
+
+	return res;
+}
+
+/* Read data to flash from file `fname` ("-" for stdin), but not more than `max_size` bytes.
+ * Return allocated buffer or NULL if failed.
+ */
+static uint8_t *read_input(const char *fname, uint32_t max_size, uint32_t *size)
+{
+	uint32_t buf_size = 64 * KiB;
+	uint8_t *buf = NULL;
+	int fd;
+	int ret;
+
+	if (!strcmp(fname, "-"))
+		fd = STDIN_FILENO;
+	else
+		fd = open(fname, O_RDONLY);
+
+	if (fd == -1) {
+		error(0, errno, "ERROR: failed to open file '%s'", fname);
+		return NULL;
+	}
+
+	*size = 0;
+	do {
+		if (*size == buf_size || !buf) {
+			uint8_t *new_buf;
+
+			buf_size = buf ? buf_size * 2 : buf_size;
+			new_buf = (uint8_t *)realloc(buf, buf_size);
+			if (!new_buf) {
+				error(0, errno, "ERROR: can not allocate memory");
+				free(buf);
+				buf = NULL;
+				break;
+			}
+			buf = new_buf;
+		}
+		ret = read(fd, buf + *size, min(buf_size, max_size) - *size);
+		if (ret == -1) {
+			error(0, errno, "ERROR: failed to read file '%s'", fname);
+			free(buf);
+			buf = NULL;
+			break;
+		}
+		*size += ret;
+	} while (ret && *size < max_size);
+
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	return buf;
+}
+
+/* Erase or flash `buf` to the same region of several chips and verify them.
+ */
+static bool multi_write(struct usb_device *dev, struct spi_flash **list, int count,
+			struct arg *arg, uint8_t *buf, uint32_t size, bool aligned)
+{
+	bool res;
+
+	// data out of region must be kept, but it is not supported by common erase of chips
+	if (!aligned) {
+		for (int i = 0; i < count; i++) {
+			dev->cs = list[i]->cs;
+			info("CS%u: ", dev->cs);
+			if (!_erase(dev, list[i], arg->offset, size))
+				return false;
+		}
+		if (!buf)
+			return true;
+	}
+
+	info("%s %u bytes from offset %u on %d chips...\n", buf ? "Flashing" : "Erasing", size,
+	     arg->offset, count);
+	res = spi_nor_multi_program(dev, list, count, arg->offset, size, buf, aligned, progress);
+	if (progress)
+		progress_close();
+
+	if (!res) {
+		error(0, errno, "ERROR: failed to %s", buf ? "flash" : "erase");
+		return false;
+	}
+	info("%s completed\n", buf ? "Flash" : "Erase");
+	for (int i = 0; i < count; i++)
+		print_stats(list[i], true);
+
+	if (buf && arg->verify) {
+		uint8_t *verify_buf = (uint8_t *)malloc(size);
+
+		if (!verify_buf) {
+			error(0, errno, "ERROR: can not allocate memory");
+			return false;
+		}
+		for (int i = 0; i < count && res; i++) {
+			struct mismatch mismatch;
+			uint32_t errors;
+
+			dev->cs = list[i]->cs;
+			info("Verification of CS%u...\n", dev->cs);
+			res = spi_nor_read(dev, list[i], arg->offset, size, verify_buf, 0, progress);
+			if (progress)
+				progress_close();
+
+			if (!res) {
+				error(0, errno, "ERROR: failed to read data");
+				break;
+			}
+			mismatch_init(&mismatch, list[i]->page);
+			errors = mismatch_compare(&mismatch, arg->offset, verify_buf, buf, size);
+			write_report(arg, list[i], &mismatch, size, 0);
+			mismatch_free(&mismatch);
+			if (errors) {
+				error(0, 0, "ERROR: found %u differences on CS%u", errors, dev->cs);
+				res = false;
+			}
+		}
+		if (res)
+			info("Verification completed\n");
+
+		free(verify_buf);
+	}
+
+	return res;
+}
+
+/* Run flash or erase command on several chips connected to different CS lines of converter.
+ * Chips are erased and programmed at the same time, verification is done chip by chip.
+ */
+static bool do_multi(struct usb_device *dev, struct spi_flash *flashes, int count,
+		     struct arg *arg)
+{
+	struct spi_flash *list[SPI_CS_COUNT];
+	struct content contents[SPI_CS_COUNT];
+	uint8_t *buf = NULL;
+	uint32_t size = arg->size;
+	bool aligned = true;
+	bool res;
+
+	if (arg->command_op->command == COMMAND_FLASH) {
+		buf = read_input(arg->args[0], arg->size, &size);
+		if (!buf)
+			return false;
+	}
+
+	for (int i = 0; i < count; i++) {
+		list[i] = &flashes[i];
+		if ((arg->offset | (arg->offset + size)) & (flashes[i].erase_block - 1))
+			aligned = false;
+		content_begin(list[i], &contents[i], arg->offset, size);
+	}
+
+	res = multi_write(dev, list, count, arg, buf, size, aligned);
+	for (int i = 0; i < count; i++)
+		content_end(&contents[i], res, arg->offset, buf, size);
+	free(buf);
+
+	return res;
+}
+
+/* Write key of converter with connected flash for cache of speeds.
+ */
+static void speed_key(struct usb_device *dev, struct spi_flash *flash, char *key, size_t len)
+{
+	snprintf(key, len, "%s/%02x%02x%02x", dev->serial, flash->ids[0], flash->ids[1],
+		 flash->ids[2]);
+	for (char *p = key; *p; p++) {
+		if (*p == ' ')
+			*p = '_';
+	}
+}
+
+/* Get SPI speed from command line or from result of autotune for this converter and flash.
+ */
+static unsigned get_speed(struct usb_device *dev, struct spi_flash *flash, struct arg *arg,
+			  bool *tuned)
+{
+	char key[USB_SERIAL_LEN + 16];
+	char value[16];
+	char *endptr;
+	unsigned long speed;
+
+	*tuned = false;
+	if (arg->speed >= 0)
+		return arg->speed;
+
+	// autotune starts from the slowest speed, custom command does not know flash
+	if (arg->command_op->command == COMMAND_AUTOTUNE || !flash->id_len)
+		return 0;
+
+	speed_key(dev, flash, key, sizeof(key));
+	if (!cache_get(SPEED_CACHE, key, value, sizeof(value)))
+		return 0;
+
+	speed = strtoul(value, &endptr, 10);
+	if (*endptr || speed >= SPI_SPEED_COUNT)
+		return 0;
+
+	*tuned = true;
+
+	return speed;
+}
+
+/* Read the same region several times at every speed. Data read at the slowest speed is
+ * reference, speed is stable if all reads give the same data. The fastest stable speed is saved
+ * to cache and used by next runs with this converter and flash.
+ */
+static bool do_autotune(struct usb_device *dev, struct spi_flash *flash, struct arg *arg)
+{
+	uint8_t *buf = (uint8_t *)malloc(arg->size);
+	uint64_t reference = 0;
+	double best_rate = 0;
+	unsigned best = 0;
+	char key[USB_SERIAL_LEN + 16];
+	char value[16];
+
+	if (!buf) {
+		error(0, errno, "ERROR: can not allocate memory");
+		return false;
+	}
+
+	info("Reading %u bytes from offset %u %d times at every speed...\n", arg->size,
+	     arg->offset, AUTOTUNE_READS);
+	for (unsigned speed = 0; speed < SPI_SPEED_COUNT; speed++) {
+		struct timespec start, end;
+		unsigned errors = 0;
+		double rate;
+
+		if (!spi_set_speed(dev, speed, false)) {
+			error(0, errno, "ERROR: failed set speed");
+			free(buf);
+			return false;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < AUTOTUNE_READS; i++) {
+			uint64_t hash;
+
+			if (!spi_nor_read(dev, flash, arg->offset, arg->size, buf, 0, NULL)) {
+				errors++;
+				continue;
+			}
+			hash = hash_update(HASH_INIT, buf, arg->size);
+			if (!speed && !i)
+				reference = hash;
+			else if (hash != reference)
+				errors++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		rate = (double)arg->size * AUTOTUNE_READS / KiB /
+		       ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+		if (errors) {
+			info("Speed %u: unstable, %u of %d reads differ\n", speed, errors,
+			     AUTOTUNE_READS);
+			if (!speed) {
+				error(0, 0, "ERROR: data is not stable even at the slowest speed");
+				free(buf);
+				return false;
+			}
+			// longer leads only get worse at higher clock
+			break;
+		}
+		info("Speed %u: stable, %.0f KiB/s\n", speed, rate);
+
+		// setting that does not really speed up is not worth the risk
+		if (rate > best_rate * 1.05) {
+			best = speed;
+			best_rate = rate;
+		}
+	}
+	free(buf);
+
+	if (!spi_set_speed(dev, best, false)) {
+		error(0, errno, "ERROR: failed set speed");
+		return false;
+	}
+
+	speed_key(dev, flash, key, sizeof(key));
+	snprintf(value, sizeof(value), "%u", best);
+	if (!cache_set(SPEED_CACHE, key, value))
+		error(0, errno, "WARNING: failed to save speed");
+
+	info("Selected speed %u for %s\n", best, key);
+
+	return true;
+}
+
+static bool do_custom(struct usb_device *dev, struct spi_flash *flash, struct arg *arg)
+{
+	uint8_t *rx_data = (uint8_t *)malloc(arg->data_rx_len);
+
+	if (!rx_data)
+		error(1, errno, "Can not allocate memory");
 
 	printf("Data to send:\n");
 	for (int i = 0; i < arg->data_len; i++)
@@ -498,6 +1618,25 @@ struct command_op command_ops[] = {
 		.func = do_custom,
 		.arguments_count = 3,
 	},
+	{
+		.command_name = "station",
+		.help = "wait for boards and flash and verify the same file on every connected board",
+		.usage = "FILE [-o] [--device] [--flash-size] [--flash-eraseblock] [--flash-page]",
+		.example = "a.dat --device 1-2",
+		.command = COMMAND_STATION,
+		.flags = FLAG_REQUIRE_SIZE | FLAG_REQUIRE_ERASE_BLOCK | FLAG_REQUIRE_PAGE,
+		.arguments_count = 2,
+	},
+	{
+		.command_name = "autotune",
+		.help = "find the fastest stable SPI speed of converter with connected flash",
+		.usage = "[-s] [-o]",
+		.example = "-s 256K",
+		.command = COMMAND_AUTOTUNE,
+		.flags = FLAG_REQUIRE_SIZE,
+		.func = do_autotune,
+		.arguments_count = 1,
+	},
 };
 
 void show_help(void)
@@ -510,17 +1649,92 @@ void show_help(void)
 		printf("   Usage: spi-flasher %s %s\n", command_ops[i].command_name, command_ops[i].usage);
 		printf("   Example: spi-flasher %s %s\n\n", command_ops[i].command_name, command_ops[i].example);
 	}
-	printf(" -h, --help           - show this message\n" \
-	       " -o, --offset OFFSET  - offset of SPI memory to read, flash or erase (default: 0)\n" \
-	       " -s, --size SIZE      - maximum size of data to read, flash or erase. If not specified,\n" \
-	       "                        then will try to read/erase all contains of memory.\n" \
-	       "                        For flash command will write not more than source file size\n" \
-	       " --verify             - verify data after flashing\n" \
-	       " --hide-progress      - do not show progress bar\n" \
-	       " --custom-duplex      - start receive data from first sended byte (only for custom command)\n" \
-	       " --flash-size SIZE    - override size of memory\n" \
-	       " --flash-eraseblock SIZE - override size of erase block\n" \
-	       " --flash-page SIZE    - override size of page\n");
+	printf(" -h, --help           - show this message\n" \
+	       " -o, --offset OFFSET  - offset of SPI memory to read, flash or erase (default: 0)\n" \
+	       " -s, --size SIZE      - maximum size of data to read, flash or erase. If not specified,\n" \
+	       "                        then will try to read/erase all contains of memory.\n" \
+	       "                        For flash command will write not more than source file size\n" \
+	       " --verify             - verify data after flashing\n" \
+	       " --hide-progress      - do not show progress bar\n" \
+	       " --custom-duplex      - start receive data from first sended byte (only for custom command)\n" \
+	       " --flash-size SIZE    - override size of memory\n" \
+	       " --flash-eraseblock SIZE - override size of erase block\n" \
+	       " --flash-page SIZE    - override size of page\n" \
+	       " --queue-depth COUNT  - count of USB transfers in flight (default: %d)\n" \
+	       " --emulate IMAGE[+IMAGE...][,IMAGE...] - use software CH341A with SPI flash stored in IMAGE\n" \
+	       "                        file, images joined by '+' are connected to CS0, CS1 and CS2\n" \
+	       " --device PATH[,PATH...] - use CH341A connected to USB port PATH (bus-port.port...).\n" \
+	       "                        Station command serves boards only on listed ports\n" \
+	       " --gang               - run command on all connected (or listed) devices in parallel\n" \
+	       " --cs CS[,CS...]      - chip select line of flash: 0, 1 or 2 (default: 0).\n" \
+	       "                        Flash and erase can use several chips at the same time\n" \
+	       " --resume             - journal read or flash of regular file and continue interrupted one\n" \
+	       " --speed SPEED        - SPI speed setting 0..%d (default: found by autotune or 0)\n" \
+	       " --plan               - show erase commands chosen for erase command, don't erase\n" \
+	       " --skip-blank         - read region before erase and skip erase if it is already blank\n" \
+	       " --delta              - flash only sectors which differ from file, erase only if needed\n" \
+	       " --cached[=COUNT]     - with --delta take data of chip from content cache, but read\n" \
+	       "                        COUNT random sectors to check it (default: %d)\n" \
+	       " --report FILE        - write map of differences found by verification to FILE\n" \
+	       "                        (implies --verify). Station command appends to FILE\n",
+	       USB_QUEUE_DEPTH_DEFAULT, SPI_SPEED_COUNT - 1, SPOT_CHECKS);
+}
+
+/* Split comma separated list `s` to array of strings.
+ */
+static bool parse_list(char *s, char ***list, int *count)
+{
+	char *saveptr;
+	char *item;
+
+	*count = 0;
+	*list = (char **)calloc(strlen(s) / 2 + 1, sizeof(char *));
+	if (!*list)
+		error(1, errno, "Can not allocate memory");
+
+	for (item = strtok_r(s, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr))
+		(*list)[(*count)++] = item;
+
+	if (!*count)
+		fprintf(stderr, "empty list '%s'\n", s);
+
+	return *count > 0;
+}
+
+/* Parse comma separated list of chip select lines.
+ */
+static bool parse_cs_list(char *s, struct arg *arg)
+{
+	char **list;
+	int count;
+	char *endptr;
+
+	if (!parse_list(s, &list, &count))
+		return false;
+
+	if (count > SPI_CS_COUNT) {
+		fprintf(stderr, "can not use more than %d chip selects\n", SPI_CS_COUNT);
+		return false;
+	}
+	for (int i = 0; i < count; i++) {
+		long cs = strtol(list[i], &endptr, 0);
+
+		if (*endptr || endptr == list[i] || cs < 0 || cs >= SPI_CS_COUNT) {
+			fprintf(stderr, "wrong chip select '%s'\n", list[i]);
+			return false;
+		}
+		for (int j = 0; j < i; j++) {
+			if (arg->cs[j] == cs) {
+				fprintf(stderr, "chip select %ld is specified twice\n", cs);
+				return false;
+			}
+		}
+		arg->cs[i] = cs;
+	}
+	arg->cs_count = count;
+	free(list);
+
+	return true;
 }
 
 /*
@@ -593,6 +1807,18 @@ int parse_arg(int argc, char *argv[], struct arg *arg)
 		{ "hide-progress", no_argument, NULL, 0 },
 		{ "custom-duplex", no_argument, NULL, 0 },
 		{ "verify", no_argument, NULL, 0 },
+		{ "queue-depth", required_argument, NULL, 0 },
+		{ "emulate", required_argument, NULL, 0 },
+		{ "device", required_argument, NULL, 0 },
+		{ "gang", no_argument, NULL, 0 },
+		{ "cs", required_argument, NULL, 0 },
+		{ "resume", no_argument, NULL, 0 },
+		{ "speed", required_argument, NULL, 0 },
+		{ "plan", no_argument, NULL, 0 },
+		{ "skip-blank", no_argument, NULL, 0 },
+		{ "delta", no_argument, NULL, 0 },
+		{ "cached", optional_argument, NULL, 0 },
+		{ "report", required_argument, NULL, 0 },
 		{ "help", no_argument, NULL, 'h' },
 		{ "offset", required_argument, NULL, 'o' },
 		{ "size", required_argument, NULL, 's' },
@@ -605,6 +1831,8 @@ int parse_arg(int argc, char *argv[], struct arg *arg)
 
 	memset(arg, 0, sizeof(*arg));
 	arg->size = 0xffffffff;
+	arg->speed = -1;
+	arg->cached = -1;
 	while ((c = getopt_long(argc, argv, "ho:s:", options, &optidx)) != -1) {
 		switch (c) {
 		case 0:
@@ -630,6 +1858,59 @@ int parse_arg(int argc, char *argv[], struct arg *arg)
 			case 5:
 				arg->verify = true;
 				break;
+			case 6:
+				if (!parse_size(optarg, &arg->queue_depth))
+					return -1;
+				if (!arg->queue_depth || arg->queue_depth > 1024) {
+					fprintf(stderr, "queue depth must be in range 1..1024\n");
+					return -1;
+				}
+				break;
+			case 7:
+				arg->emulate = true;
+				// fall through
+			case 8:
+				if (!parse_list(optarg, &arg->devices, &arg->devices_count))
+					return -1;
+				break;
+			case 9:
+				arg->gang = true;
+				break;
+			case 10:
+				if (!parse_cs_list(optarg, arg))
+					return -1;
+				break;
+			case 11:
+				arg->resume = true;
+				break;
+			case 12:
+				arg->speed = strtol(optarg, &endptr, 0);
+				if (*endptr || arg->speed < 0 || arg->speed >= SPI_SPEED_COUNT) {
+					fprintf(stderr, "speed must be in range 0..%d\n",
+						SPI_SPEED_COUNT - 1);
+					return -1;
+				}
+				break;
+			case 13:
+				arg->plan = true;
+				break;
+			case 14:
+				arg->skip_blank = true;
+				break;
+			case 15:
+				arg->delta = true;
+				break;
+			case 16:
+				arg->cached = optarg ? strtol(optarg, &endptr, 0) : SPOT_CHECKS;
+				if ((optarg && *endptr) || arg->cached < 0) {
+					fprintf(stderr, "count of spot checks must be positive\n");
+					return -1;
+				}
+				break;
+			case 17:
+				arg->report = optarg;
+				arg->verify = true;
+				break;
 			default:
 				break;
 			}
@@ -698,17 +1979,491 @@ int parse_arg(int argc, char *argv[], struct arg *arg)
 		args_idx++;
 	}
 
+	if (arg->command_op->command == COMMAND_AUTOTUNE && arg->size == 0xffffffff)
+		arg->size = AUTOTUNE_SIZE;
+
 	// Disable progress bar if data output to stdout
 	if (arg->command_op->command == COMMAND_READ && !strcmp(arg->args[0], "-"))
 		arg->hide_progress = true;
 
+	// in station mode listed devices are served one by one
+	if (arg->devices_count > 1 && arg->command_op->command != COMMAND_STATION)
+		arg->gang = true;
+
+	if (arg->cs_count > 1) {
+		if (arg->command_op->command != COMMAND_FLASH &&
+		    arg->command_op->command != COMMAND_ERASE) {
+			fprintf(stderr, "several chip selects can be used only by flash and erase\n");
+			return -1;
+		}
+		if (arg->gang) {
+			fprintf(stderr, "several chip selects can not be used in gang mode\n");
+			return -1;
+		}
+	}
+
+	if (arg->resume) {
+		if (arg->command_op->command != COMMAND_FLASH &&
+		    arg->command_op->command != COMMAND_READ) {
+			fprintf(stderr, "only read and flash commands can be resumed\n");
+			return -1;
+		}
+		if (!strcmp(arg->args[0], "-") || arg->gang || arg->cs_count > 1) {
+			fprintf(stderr, "resume is supported only for one chip and regular file\n");
+			return -1;
+		}
+	}
+
+	if (arg->delta && (arg->command_op->command != COMMAND_FLASH || arg->cs_count > 1 ||
+			   arg->resume)) {
+		fprintf(stderr, "delta is supported only for flash of one chip without resume\n");
+		return -1;
+	}
+
+	if (arg->cached >= 0 && !arg->delta) {
+		fprintf(stderr, "content cache is used only by delta flash\n");
+		return -1;
+	}
+
+	if (arg->plan && (arg->command_op->command != COMMAND_ERASE || arg->gang ||
+			  arg->cs_count > 1)) {
+		fprintf(stderr, "plan can be shown only for erase command of one chip\n");
+		return -1;
+	}
+
+	if (arg->gang) {
+		if (arg->command_op->command != COMMAND_FLASH &&
+		    arg->command_op->command != COMMAND_ERASE) {
+			fprintf(stderr, "gang mode supports only flash and erase commands\n");
+			return -1;
+		}
+		if (arg->command_op->command == COMMAND_FLASH && !strcmp(arg->args[0], "-")) {
+			fprintf(stderr, "gang mode can not flash data from stdin\n");
+			return -1;
+		}
+	}
+
 	return 1;
 }
 
+/* Detect flash, apply parameters from command line and check that flash parameters are known
+ * enough to run command. Return false if command can not be run.
+ */
+static bool setup_device(struct usb_device *dev, struct spi_flash *flash, struct arg *arg)
+{
+	unsigned speed;
+	bool tuned;
+
+	// ID is read at the slowest speed
+	if (!spi_set_speed(dev, 0, false)) {
+		error(0, errno, "ERROR: failed set speed");
+		return false;
+	}
+
+	if (!(arg->command_op->flags & FLAG_SKIP_FLASH_INIT)) {
+		if (!spi_nor_init(dev, flash)) {
+			error(0, errno, "ERROR: failed to read flash ID");
+			return false;
+		}
+		if (arg->flash_size)
+			spi_nor_set_size(flash, arg->flash_size);
+
+		if (arg->flash_eraseblock)
+			spi_nor_set_erase_block(flash, arg->flash_eraseblock);
+
+		if (arg->flash_page)
+			flash->page = arg->flash_page;
+
+		flash->skip_blank = arg->skip_blank;
+		flash->delta = arg->delta;
+	} else {
+		spi_nor_get_empty_flash(flash);
+	}
+
+	speed = get_speed(dev, flash, arg, &tuned);
+	if (speed && !spi_set_speed(dev, speed, false)) {
+		error(0, errno, "ERROR: failed set speed");
+		return false;
+	}
+
+	if (!(arg->command_op->flags & FLAG_SKIP_FLASH_INIT)) {
+		if (!gang_self) {
+			fprintf(stderr, "Flash:      %s%s\n", flash->name, flash->sfdp ? " (SFDP)" : "");
+			fprintf(stderr, "Size:       ");
+			print_size(stderr, flash->size, true);
+			fprintf(stderr, "EraseBlock: ");
+			print_size(stderr, flash->erase_block, true);
+			fprintf(stderr, "Page:       ");
+			print_size(stderr, flash->page, true);
+			fprintf(stderr, "ID:        ");
+			for (int i = 0; i < flash->id_len; i++)
+				fprintf(stderr, " %02x", flash->ids[i]);
+			if (flash->uid_len) {
+				fprintf(stderr, "\nUID:        ");
+				for (int i = 0; i < flash->uid_len; i++)
+					fprintf(stderr, "%02x", flash->uid[i]);
+			}
+
+			fprintf(stderr, "\nSpeed:      %u%s\n\n", speed, tuned ? " (tuned)" : "");
+			fprintf(stderr, "arg.offset: ");
+			print_size(stderr, arg->offset, true);
+			fprintf(stderr, "arg.size:   ");
+			if (arg->size == 0xffffffff)
+				fprintf(stderr, "maximum");
+			else
+				print_size(stderr, arg->size, true);
+			fprintf(stderr, "\n");
+		}
+	}
+
+	if ((arg->command_op->flags & FLAG_REQUIRE_SIZE) && !flash->size) {
+		fprintf(stderr, "ERROR: Unknown flash size\n");
+		return false;
+	}
+	if ((arg->command_op->flags & FLAG_REQUIRE_ERASE_BLOCK) && !flash->erase_block) {
+		fprintf(stderr, "ERROR: Unknown erase block size\n");
+		return false;
+	}
+	if ((arg->command_op->flags & FLAG_REQUIRE_PAGE) && !flash->page) {
+		fprintf(stderr, "ERROR: Unknown page size\n");
+		return false;
+	}
+	if ((arg->command_op->flags & FLAG_REQUIRE_SIZE) &&
+	    (uint64_t)arg->offset + arg->size > flash->size) {
+		// For COMMAND_FLASH size will be ajusted in do_flash().
+		// Now arg.size is maximal and this is normal.
+		if (arg->command_op->command != COMMAND_FLASH &&
+		    arg->command_op->command != COMMAND_STATION && !gang_self)
+			fprintf(stderr, "WARNING: size is truncated to SPI memory size\n");
+
+		arg->size = flash->size - arg->offset;
+	}
+
+	return true;
+}
+
+static void *gang_run_worker(void *data)
+{
+	struct gang_worker *worker = (struct gang_worker *)data;
+	struct timespec start, end;
+	const char *status;
+
+	gang_self = worker;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (!usb_open(&worker->dev)) {
+		status = "NO DEVICE";
+	} else {
+		if (!setup_device(&worker->dev, &worker->flash, &worker->arg))
+			status = "NO FLASH";
+		else if (!worker->arg.command_op->func(&worker->dev, &worker->flash, &worker->arg))
+			status = "FAIL";
+		else
+			status = "PASS";
+
+		usb_close(&worker->dev);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pthread_mutex_lock(&gang_lock);
+	worker->time = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	worker->status = status;
+	pthread_mutex_unlock(&gang_lock);
+
+	return NULL;
+}
+
+/* Run command on several devices in parallel, one thread per device.
+ * Return count of failed devices.
+ */
+static int run_gang(struct arg *arg)
+{
+	char **paths = arg->devices;
+	int failed = 0;
+
+	if (!arg->devices_count) {
+		arg->devices_count = usb_enumerate(&paths);
+		if (arg->devices_count < 0)
+			error(1, errno, "ERROR: failed to enumerate USB devices");
+		if (!arg->devices_count)
+			error(1, 0, "ERROR: no devices found");
+	}
+
+	gang_count = arg->devices_count;
+	gang_workers = (struct gang_worker *)calloc(gang_count, sizeof(*gang_workers));
+	if (!gang_workers)
+		error(1, errno, "Can not allocate memory");
+
+	printf("Running %s on %d devices...\n", arg->command_op->command_name, gang_count);
+	for (int i = 0; i < gang_count; i++) {
+		struct gang_worker *worker = &gang_workers[i];
+
+		worker->arg = *arg;
+		worker->last_percent = (uint32_t)-1;
+		worker->dev.queue_depth = arg->queue_depth;
+		worker->dev.path = paths[i];
+		worker->dev.cs = arg->cs[0];
+		if (arg->emulate)
+			worker->dev.ops = &emul_ops;
+
+		if (pthread_create(&worker->thread, NULL, gang_run_worker, worker))
+			error(1, errno, "ERROR: failed to create thread");
+	}
+	for (int i = 0; i < gang_count; i++)
+		pthread_join(gang_workers[i].thread, NULL);
+
+	printf("\n\n%-20s %-24s %-10s %s\n", "Device", "Flash", "Result", "Time");
+	for (int i = 0; i < gang_count; i++) {
+		struct gang_worker *worker = &gang_workers[i];
+
+		printf("%-20s %-24s %-10s %.1fs\n", worker->dev.path,
+		       worker->flash.name ? worker->flash.name : "-", worker->status, worker->time);
+		if (strcmp(worker->status, "PASS"))
+			failed++;
+
+		spi_nor_release(&worker->flash);
+	}
+	printf("\n%d passed, %d failed\n", gang_count - failed, failed);
+
+	return failed;
+}
+
+/* Check that converter at `path` can be used by station.
+ */
+static bool station_accept(struct arg *arg, const char *path)
+{
+	if (!arg->devices_count)
+		return true;
+
+	for (int i = 0; i < arg->devices_count; i++) {
+		if (!strcmp(arg->devices[i], path))
+			return true;
+	}
+
+	return false;
+}
+
+static void station_close(struct station *station)
+{
+	if (station->opened)
+		usb_close(&station->dev);
+
+	station->opened = false;
+}
+
+/* Handle connect and disconnect of converters, wait up to STATION_POLL_MS.
+ */
+static bool station_poll(struct station *station, struct arg *arg)
+{
+	enum usb_event event;
+	char path[USB_PATH_LEN];
+
+	if (!usb_monitor_wait(&station->monitor, STATION_POLL_MS, &event, path))
+		return false;
+
+	if (event == USB_EVENT_ARRIVED && !station->path[0] && station_accept(arg, path)) {
+		strcpy(station->path, path);
+	} else if (event == USB_EVENT_LEFT && !strcmp(station->path, path)) {
+		station_close(station);
+		station->path[0] = '\0';
+	}
+
+	// converter is opened after connect or after error of previous board
+	if (station->path[0] && !station->opened) {
+		station->dev.path = station->path;
+		station->opened = usb_open(&station->dev);
+		if (station->opened && !spi_set_speed(&station->dev, 0, false))
+			station_close(station);
+	}
+
+	return true;
+}
+
+/* Wait until converter is connected and flash is found on it. In emulation every image is a
+ * board connected after the previous one. Return false if there are no more boards.
+ */
+static bool station_wait_board(struct station *station, struct arg *arg)
+{
+	bool present;
+
+	if (arg->emulate) {
+		if (station->next_image >= arg->devices_count)
+			return false;
+
+		station->dev.path = arg->devices[station->next_image++];
+		station->opened = usb_open(&station->dev);
+
+		return station->opened;
+	}
+
+	while (station_poll(station, arg)) {
+		if (!station->opened)
+			continue;
+
+		if (!spi_nor_is_present(&station->dev, &present))
+			station_close(station);
+		else if (present)
+			return true;
+	}
+
+	return false;
+}
+
+/* Wait until flash or converter is disconnected.
+ */
+static void station_wait_removal(struct station *station, struct arg *arg)
+{
+	bool present = true;
+
+	if (arg->emulate) {
+		station_close(station);
+		return;
+	}
+
+	while (station->opened && present) {
+		if (!station_poll(station, arg))
+			return;
+
+		if (station->opened && !spi_nor_is_present(&station->dev, &present))
+			station_close(station);
+	}
+}
+
+/* Erase, flash and verify image on one board.
+ */
+static bool station_flash_board(struct usb_device *dev, struct arg *arg, uint8_t *image,
+				uint32_t size, uint8_t *verify_buf, uint32_t board)
+{
+	struct spi_flash flash = { 0 };
+	struct content content = { 0 };
+	struct arg board_arg = *arg;
+	uint32_t errors;
+	bool res;
+
+	res = setup_device(dev, &flash, &board_arg);
+	if (res && arg->offset + size > flash.size) {
+		error(0, 0, "ERROR: image does not fit to flash");
+		res = false;
+	}
+	if (res) {
+		content_begin(&flash, &content, arg->offset, size);
+		res = _erase(dev, &flash, arg->offset, size);
+	}
+
+	if (res) {
+		info("Flashing %u bytes from offset %u...\n", size, arg->offset);
+		res = spi_nor_program_smart(dev, &flash, arg->offset, size, NULL, image, 0, false,
+					    progress);
+		if (progress)
+			progress_close();
+		if (!res)
+			error(0, errno, "ERROR: failed to flash");
+	}
+
+	if (res) {
+		info("Verification...\n");
+		res = spi_nor_read(dev, &flash, arg->offset, size, verify_buf, 0, progress);
+		if (progress)
+			progress_close();
+		if (!res)
+			error(0, errno, "ERROR: failed to read data");
+	}
+
+	if (res) {
+		struct mismatch mismatch;
+
+		mismatch_init(&mismatch, flash.page);
+		errors = mismatch_compare(&mismatch, arg->offset, verify_buf, image, size);
+		write_report(arg, &flash, &mismatch, size, board);
+		mismatch_free(&mismatch);
+		if (errors) {
+			error(0, 0, "ERROR: found %u differences", errors);
+			res = false;
+		}
+	}
+	content_end(&content, res, arg->offset, image, size);
+	spi_nor_release(&flash);
+
+	return res;
+}
+
+/* Flash the same image to boards connected one after another. Image is read once, converter and
+ * flash are detected by USB hotplug and polling of flash ID, so time of every board is time of
+ * erase, flash and verify only. Return false if any board failed.
+ */
+static bool run_station(struct arg *arg)
+{
+	struct station station = { 0 };
+	struct timespec start, end;
+	uint8_t *image;
+	uint8_t *verify_buf;
+	uint32_t size;
+	uint32_t passed = 0;
+	uint32_t failed = 0;
+
+	image = read_input(arg->args[0], arg->size, &size);
+	if (!image)
+		return false;
+
+	verify_buf = (uint8_t *)malloc(size);
+	if (!size || !verify_buf) {
+		error(0, errno, "ERROR: %s", size ? "can not allocate memory" : "file is empty");
+		free(image);
+		return false;
+	}
+
+	if (!arg->emulate && !usb_monitor_open(&station.monitor)) {
+		error(0, errno, "ERROR: USB hotplug is not available");
+		free(verify_buf);
+		free(image);
+		return false;
+	}
+	station.dev.queue_depth = arg->queue_depth;
+	station.dev.cs = arg->cs[0];
+	if (arg->emulate)
+		station.dev.ops = &emul_ops;
+
+	printf("Station is ready to flash %u bytes from offset %u\n", size, arg->offset);
+	while (1) {
+		bool res;
+
+		if (!arg->emulate)
+			printf("Waiting for board...\n");
+
+		if (!station_wait_board(&station, arg))
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		res = station_flash_board(&station.dev, arg, image, size, verify_buf,
+					  passed + failed + 1);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (res)
+			passed++;
+		else
+			failed++;
+
+		printf("Board %u: %s (%.1fs), %u passed, %u failed\n", passed + failed,
+		       res ? "PASS" : "FAIL",
+		       (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+		       passed, failed);
+		if (!arg->emulate)
+			printf("Disconnect board...\n");
+		fflush(stdout);
+
+		station_wait_removal(&station, arg);
+	}
+
+	station_close(&station);
+	usb_monitor_close(&station.monitor);
+	free(verify_buf);
+	free(image);
+
+	return !failed;
+}
+
 int main(int argc, char *argv[])
 {
-	struct usb_device dev;
-	struct spi_flash *flash;
+	struct usb_device dev = { 0 };
+	struct spi_flash flashes[SPI_CS_COUNT] = { 0 };
 	struct arg arg;
 	int parse_res;
 	int retcode = 0;
@@ -719,82 +2474,65 @@ int main(int argc, char *argv[])
 		return -parse_res;
 
 	if (!arg.hide_progress) {
-		if (strstr(locale, ".UTF-8") || strstr(locale, ".utf-8"))
+		if (arg.gang)
+			progress = progress_gang;
+		else if (strstr(locale, ".UTF-8") || strstr(locale, ".utf-8"))
 			progress = progress_utf8;
 		else
 			progress = progress_ascii;
 	}
 
-	if (!usb_open(&dev))
-		error(1, errno, "ERROR: failed to open USB device");
+	if (arg.command_op->command == COMMAND_STATION)
+		return run_station(&arg) ? 0 : 1;
 
-	if (!spi_set_speed(&dev, false))
-		error(1, errno, "ERROR: failed set speed");
+	// every chip appends its section to report, so report of previous run is removed first
+	if (arg.report) {
+		FILE *f = fopen(arg.report, "w");
 
-	if (!(arg.command_op->flags & FLAG_SKIP_FLASH_INIT)) {
-		flash = spi_nor_init(&dev);
-		if (arg.flash_size)
-			flash->size = arg.flash_size;
+		if (!f || fclose(f))
+			error(1, errno, "ERROR: failed to create report '%s'", arg.report);
+	}
 
-		if (arg.flash_eraseblock)
-			flash->erase_block = arg.flash_eraseblock;
+	if (arg.gang)
+		return run_gang(&arg) ? 1 : 0;
 
-		if (arg.flash_page)
-			flash->page = arg.flash_page;
+	dev.queue_depth = arg.queue_depth;
+	if (arg.devices_count)
+		dev.path = arg.devices[0];
+	if (arg.emulate)
+		dev.ops = &emul_ops;
 
-		fprintf(stderr, "Flash:      %s\n", flash->name);
-		fprintf(stderr, "Size:       ");
-		print_size(stderr, flash->size, true);
-		fprintf(stderr, "EraseBlock: ");
-		print_size(stderr, flash->erase_block, true);
-		fprintf(stderr, "Page:       ");
-		print_size(stderr, flash->page, true);
-		fprintf(stderr, "ID:        ");
-		for (int i = 0; i < flash->id_len; i++)
-			fprintf(stderr, " %02x", flash->ids[i]);
-
-		fprintf(stderr, "\n\n");
-		fprintf(stderr, "arg.offset: ");
-		print_size(stderr, arg.offset, true);
-		fprintf(stderr, "arg.size:   ");
-		if (arg.size == 0xffffffff)
-			fprintf(stderr, "maximum");
-		else
-			print_size(stderr, arg.size, true);
-		fprintf(stderr, "\n");
-	} else {
-		flash = spi_nor_get_empty_flash();
-	}
+	if (!usb_open(&dev))
+		error(1, errno, "ERROR: failed to open USB device");
 
-	if ((arg.command_op->flags & FLAG_REQUIRE_SIZE) && !flash->size) {
-		fprintf(stderr, "ERROR: Unknown flash size\n");
-		usb_close(&dev);
-		return 1;
-	}
-	if ((arg.command_op->flags & FLAG_REQUIRE_ERASE_BLOCK) && !flash->erase_block) {
-		fprintf(stderr, "ERROR: Unknown erase block size\n");
-		usb_close(&dev);
-		return 1;
-	}
-	if ((arg.command_op->flags & FLAG_REQUIRE_PAGE) && !flash->page) {
-		fprintf(stderr, "ERROR: Unknown page size\n");
-		usb_close(&dev);
-		return 1;
-	}
-	if ((arg.command_op->flags & FLAG_REQUIRE_SIZE) && (arg.offset + arg.size > flash->size)) {
-		// For COMMAND_FLASH size will be ajusted in do_flash().
-		// Now arg.size is maximal and this is normal.
-		if (arg.command_op->command != COMMAND_FLASH)
-			fprintf(stderr, "WARNING: size is truncated to SPI memory size\n");
+	for (int i = 0; i < max(arg.cs_count, 1); i++) {
+		dev.cs = arg.cs[i];
+		if (arg.cs_count > 1)
+			fprintf(stderr, "CS%u:\n", dev.cs);
 
-		arg.size = flash->size - arg.offset;
+		if (!setup_device(&dev, &flashes[i], &arg)) {
+			retcode = 1;
+			break;
+		}
 	}
 
-	if (!arg.command_op->func(&dev, flash, &arg)) {
-		fprintf(stderr, "ERROR: failed to run %s command\n", arg.command_op->command_name);
-		retcode = 1;
+	if (!retcode) {
+		bool res;
+
+		if (arg.cs_count > 1)
+			res = do_multi(&dev, flashes, arg.cs_count, &arg);
+		else
+			res = arg.command_op->func(&dev, &flashes[0], &arg);
+
+		if (!res) {
+			fprintf(stderr, "ERROR: failed to run %s command\n",
+				arg.command_op->command_name);
+			retcode = 1;
+		}
 	}
 
+	for (int i = 0; i < SPI_CS_COUNT; i++)
+		spi_nor_release(&flashes[i]);
 	usb_close(&dev);
 
 	return retcode;
@@ -0,0 +1,159 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mismatch.h"
+#include "simd.h"
+
+/* Return pointer to new element at end of array `*items` of `*count` elements, array grows by
+ * doubling. NULL if array reached MISMATCH_MAX or memory can not be allocated.
+ */
+static void *mismatch_append(void **items, uint32_t *count, size_t item_size)
+{
+	uint32_t n = *count;
+
+	if (n >= MISMATCH_MAX)
+		return NULL;
+
+	// capacity is the power of 2 not less than count, so it is full when count is power of 2
+	if (!(n & (n - 1))) {
+		void *new_items = realloc(*items, (n ? n * 2 : 16) * item_size);
+
+		if (!new_items)
+			return NULL;
+		*items = new_items;
+	}
+	(*count)++;
+
+	return (uint8_t *)*items + n * item_size;
+}
+
+/* Add differing bits of byte at `addr` to its page.
+ */
+static void mismatch_add_byte(struct mismatch *mismatch, uint32_t addr, uint8_t read,
+			      uint8_t data)
+{
+	uint32_t page_addr = addr - addr % mismatch->page;
+	struct mismatch_page *page = NULL;
+	unsigned stuck1 = __builtin_popcount(read & ~data & 0xff);
+	unsigned stuck0 = __builtin_popcount(~read & data & 0xff);
+
+	mismatch->bytes++;
+	mismatch->stuck1 += stuck1;
+	mismatch->stuck0 += stuck0;
+
+	if (mismatch->pages_count && mismatch->pages[mismatch->pages_count - 1].addr == page_addr) {
+		page = &mismatch->pages[mismatch->pages_count - 1];
+	} else {
+		page = mismatch_append((void **)&mismatch->pages, &mismatch->pages_count,
+				       sizeof(*page));
+		if (!page) {
+			mismatch->truncated = true;
+			return;
+		}
+		page->addr = page_addr;
+		page->stuck1 = 0;
+		page->stuck0 = 0;
+	}
+	page->stuck1 += stuck1;
+	page->stuck0 += stuck0;
+}
+
+/* Add run of differing bytes from `start` to `end`. It is joined to the last range if it is
+ * close enough.
+ */
+static void mismatch_add_range(struct mismatch *mismatch, uint32_t start, uint32_t end)
+{
+	struct mismatch_range *range = NULL;
+
+	if (mismatch->ranges_count)
+		range = &mismatch->ranges[mismatch->ranges_count - 1];
+
+	if (range && start >= range->end && start - range->end < MISMATCH_GAP) {
+		range->end = end;
+		range->bytes += end - start;
+		return;
+	}
+
+	range = mismatch_append((void **)&mismatch->ranges, &mismatch->ranges_count,
+				sizeof(*range));
+	if (!range) {
+		mismatch->truncated = true;
+		return;
+	}
+	range->start = start;
+	range->end = end;
+	range->bytes = end - start;
+}
+
+/* Prepare empty map for flash with page size `page`.
+ */
+void mismatch_init(struct mismatch *mismatch, uint32_t page)
+{
+	memset(mismatch, 0, sizeof(*mismatch));
+	mismatch->page = page ? page : 256;
+}
+
+/* Compare `len` bytes `read` from flash at `addr` with expected `data` and add differences to
+ * map. Equal parts are skipped by vectorized compare. Return count of differing bytes.
+ */
+uint32_t mismatch_compare(struct mismatch *mismatch, uint32_t addr, const uint8_t *read,
+			  const uint8_t *data, uint32_t len)
+{
+	uint32_t errors = 0;
+	uint32_t pos = 0;
+
+	while ((pos += simd_diff(read + pos, data + pos, len - pos)) < len) {
+		uint32_t start = pos;
+
+		for (; pos < len && read[pos] != data[pos]; pos++)
+			mismatch_add_byte(mismatch, addr + pos, read[pos], data[pos]);
+
+		mismatch_add_range(mismatch, addr + start, addr + pos);
+		errors += pos - start;
+	}
+
+	return errors;
+}
+
+/* Write map as tab-separated lines: "range <start> <end> <bytes>", "page <address> <pattern>
+ * <stuck-1 bits> <stuck-0 bits>" and "total <bytes> <stuck-1 bits> <stuck-0 bits>". Pattern of
+ * page is "stuck-1", "stuck-0" or "mixed". Line "truncated" is added if map is not full.
+ */
+void mismatch_print(struct mismatch *mismatch, FILE *f)
+{
+	for (uint32_t i = 0; i < mismatch->ranges_count; i++) {
+		struct mismatch_range *range = &mismatch->ranges[i];
+
+		fprintf(f, "range\t0x%08x\t0x%08x\t%u\n", range->start, range->end, range->bytes);
+	}
+
+	for (uint32_t i = 0; i < mismatch->pages_count; i++) {
+		struct mismatch_page *page = &mismatch->pages[i];
+		const char *pattern = "mixed";
+
+		if (!page->stuck0)
+			pattern = "stuck-1";
+		else if (!page->stuck1)
+			pattern = "stuck-0";
+		fprintf(f, "page\t0x%08x\t%s\t%u\t%u\n", page->addr, pattern, page->stuck1,
+			page->stuck0);
+	}
+
+	fprintf(f, "total\t%llu\t%llu\t%llu\n", (unsigned long long)mismatch->bytes,
+		(unsigned long long)mismatch->stuck1, (unsigned long long)mismatch->stuck0);
+	if (mismatch->truncated)
+		fprintf(f, "truncated\n");
+}
+
+void mismatch_free(struct mismatch *mismatch)
+{
+	free(mismatch->ranges);
+	free(mismatch->pages);
+	mismatch->ranges = NULL;
+	mismatch->pages = NULL;
+	mismatch->ranges_count = 0;
+	mismatch->pages_count = 0;
+}
@@ -0,0 +1,49 @@
+#ifndef _MISMATCH_H
+#define _MISMATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define MISMATCH_GAP 16    // differences closer than this are joined to one range
+#define MISMATCH_MAX 4096  // limit of count of ranges and of pages in map
+
+// region of flash with differences, equal bytes inside of it are shorter than MISMATCH_GAP
+struct mismatch_range {
+	uint32_t start;
+	uint32_t end;      // address after the last differing byte
+	uint32_t bytes;    // differing bytes in range
+};
+
+// differing bits of one page of flash
+struct mismatch_page {
+	uint32_t addr;
+	uint32_t stuck1;   // bits read as 1 where data has 0
+	uint32_t stuck0;   // bits read as 0 where data has 1
+};
+
+/*
+ * Map of differences between data read back from flash and data written to it. Bits that stay 1
+ * mean that page was not programmed or was erased later, bits that stay 0 mean that region was
+ * not erased or bits were changed by program of other data. Ranges and pages are sorted by
+ * address if regions are compared in order.
+ */
+struct mismatch {
+	uint32_t page;                  // size of page of flash
+	uint64_t bytes;                 // all differing bytes
+	uint64_t stuck1;                // all bits read as 1 where data has 0
+	uint64_t stuck0;                // all bits read as 0 where data has 1
+	struct mismatch_range *ranges;
+	uint32_t ranges_count;
+	struct mismatch_page *pages;
+	uint32_t pages_count;
+	bool truncated;                 // some ranges or pages are not kept, totals are exact
+};
+
+void mismatch_init(struct mismatch *mismatch, uint32_t page);
+uint32_t mismatch_compare(struct mismatch *mismatch, uint32_t addr, const uint8_t *read,
+			  const uint8_t *data, uint32_t len);
+void mismatch_print(struct mismatch *mismatch, FILE *f);
+void mismatch_free(struct mismatch *mismatch);
+
+#endif
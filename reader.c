@@ -0,0 +1,137 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "reader.h"
+
+
+// map data of regular file from current position
+static bool reader_map(struct reader *reader)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct stat stat;
+
+	if (fstat(reader->fd, &stat) || !S_ISREG(stat.st_mode))
+		return false;
+
+	reader->pos = lseek(reader->fd, 0, SEEK_CUR);
+	if (reader->pos == (off_t)-1 || reader->pos >= stat.st_size)
+		return false;
+
+	reader->end = min(stat.st_size, reader->pos + (off_t)reader->remain);
+	reader->map_start = reader->pos & ~(off_t)(page - 1);
+	reader->map_len = reader->end - reader->map_start;
+	// private mapping, pages are never written back even if data is changed by caller
+	reader->map = (uint8_t *)mmap(NULL, reader->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+				      reader->fd, reader->map_start);
+	if (reader->map == MAP_FAILED) {
+		reader->map = NULL;
+		return false;
+	}
+	madvise(reader->map, reader->map_len, MADV_SEQUENTIAL);
+
+	return true;
+}
+
+/* Prepare input of not more than `size` bytes from `fd` from its current position.
+ */
+bool reader_open(struct reader *reader, int fd, uint32_t size)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = fd;
+	reader->remain = size;
+	if (reader_map(reader))
+		return true;
+
+	reader->buf_len = READER_BUF;
+	reader->buf = (uint8_t *)malloc(reader->buf_len);
+
+	return reader->buf != NULL;
+}
+
+/* Read to buffer until it has `len` bytes or file ends. Everything that is available (up to free
+ * space of buffer) is read by one call, short read of pipe is not end of file.
+ */
+static bool reader_fill(struct reader *reader, uint32_t len)
+{
+	if (reader->head + len > reader->buf_len) {
+		if (len > reader->buf_len) {
+			uint8_t *buf = (uint8_t *)realloc(reader->buf, len);
+
+			if (!buf)
+				return false;
+			reader->buf = buf;
+			reader->buf_len = len;
+		}
+		memmove(reader->buf, reader->buf + reader->head, reader->fill);
+		reader->head = 0;
+	}
+
+	while (reader->fill < len && !reader->eof) {
+		uint32_t start = reader->head + reader->fill;
+		ssize_t ret = read(reader->fd, reader->buf + start,
+				   min(reader->buf_len - start, reader->remain));
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret == -1)
+			return false;
+
+		reader->eof = !ret;
+		reader->fill += ret;
+		reader->remain -= ret;
+	}
+
+	return true;
+}
+
+/* Return next `*len` bytes of data. `*len` is less than requested only at end of data. Data is
+ * valid until next call.
+ * Return NULL if failed to read file.
+ */
+uint8_t *reader_get(struct reader *reader, uint32_t *len)
+{
+	uint8_t *data;
+
+	if (reader->map) {
+		*len = min(*len, reader->end - reader->pos);
+		data = reader->map + (reader->pos - reader->map_start);
+		reader->pos += *len;
+
+		return data;
+	}
+
+	if (!reader->remain)
+		reader->eof = true;
+	if (!reader_fill(reader, *len))
+		return NULL;
+
+	*len = min(*len, reader->fill);
+	data = reader->buf + reader->head;
+	reader->head += *len;
+	reader->fill -= *len;
+
+	return data;
+}
+
+/* Release reader. File position of mapped file is set after taken data as by read(). Buffered
+ * data that was not taken is lost, so size of reader_open() must not exceed needed data.
+ */
+bool reader_close(struct reader *reader)
+{
+	bool res = true;
+
+	if (reader->map) {
+		munmap(reader->map, reader->map_len);
+		res = lseek(reader->fd, reader->pos, SEEK_SET) != (off_t)-1;
+	}
+	free(reader->buf);
+	memset(reader, 0, sizeof(*reader));
+
+	return res;
+}
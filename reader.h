@@ -0,0 +1,38 @@
+#ifndef _READER_H
+#define _READER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+#define READER_BUF (1 * MiB)  // read-ahead of file that can not be mapped
+
+/*
+ * Input of data from file by large parts. Regular file is mapped from current position, other
+ * files (pipes) are read to buffer as much as available, so one read() takes many pages. Not
+ * more than size given to reader_open() is taken from file, data after it stays in pipe.
+ */
+struct reader {
+	int fd;
+	uint32_t remain;     // bytes that can be taken from file
+	// mapped file
+	uint8_t *map;
+	size_t map_len;
+	off_t map_start;     // file position of mapping, aligned to page
+	off_t pos;           // file position of next data
+	off_t end;           // end of mapped data
+	// buffered file
+	uint8_t *buf;
+	uint32_t buf_len;
+	uint32_t head;       // next data in buffer
+	uint32_t fill;       // bytes of data from `head`
+	bool eof;
+};
+
+bool reader_open(struct reader *reader, int fd, uint32_t size);
+uint8_t *reader_get(struct reader *reader, uint32_t *len);
+bool reader_close(struct reader *reader);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * Microbenchmark of bit reverse: every implementation of simd.c is compared with the byte table
+ * (bitrev_scalar) on buffers of size of large USB reads. Build by "make bench".
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "simd.c"
+
+#define BENCH_SIZE   (4 * 1024 * 1024)
+#define BENCH_ROUNDS 64
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Print speed of `func` in MiB/s and check its result with table.
+ */
+static void bench_run(const char *name, void (*func)(uint8_t *dst, const uint8_t *src, size_t len),
+		      uint8_t *dst, const uint8_t *src, const uint8_t *expected)
+{
+	double start;
+	double time;
+
+	func(dst, src, BENCH_SIZE);  // pages of `dst` are touched before measure
+	start = bench_now();
+	for (int i = 0; i < BENCH_ROUNDS; i++)
+		func(dst, src, BENCH_SIZE);
+	time = bench_now() - start;
+
+	printf("%-8s %8.0f MiB/s%s\n", name, BENCH_ROUNDS * (BENCH_SIZE / 1048576.0) / time,
+	       memcmp(dst, expected, BENCH_SIZE) ? "  WRONG RESULT" : "");
+}
+
+int main(void)
+{
+	uint8_t *src = (uint8_t *)malloc(BENCH_SIZE);
+	uint8_t *dst = (uint8_t *)malloc(BENCH_SIZE);
+	uint8_t *expected = (uint8_t *)malloc(BENCH_SIZE);
+
+	if (!src || !dst || !expected)
+		return 1;
+
+	for (size_t i = 0; i < BENCH_SIZE; i++)
+		src[i] = rand();
+	bitrev_scalar(expected, src, BENCH_SIZE);
+
+	printf("Bit reverse of %u MiB buffer, %d rounds\n", BENCH_SIZE / 1048576, BENCH_ROUNDS);
+	bench_run("table", bitrev_scalar, dst, src, expected);
+#ifdef SIMD_X86
+	if (__builtin_cpu_supports("ssse3"))
+		bench_run("ssse3", bitrev_ssse3, dst, src, expected);
+	if (__builtin_cpu_supports("avx2"))
+		bench_run("avx2", bitrev_avx2, dst, src, expected);
+#endif
+#ifdef SIMD_NEON
+	bench_run("neon", bitrev_neon, dst, src, expected);
+#endif
+	bench_run("selected", simd_bitrev, dst, src, expected);
+
+	free(src);
+	free(dst);
+	free(expected);
+
+	return 0;
+}
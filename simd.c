@@ -0,0 +1,331 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+#include "simd.h"
+
+static const uint8_t reverse_table[] = {
+	0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
+	0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
+	0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8,
+	0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
+	0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4,
+	0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
+	0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec,
+	0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
+	0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2,
+	0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
+	0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea,
+	0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
+	0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6,
+	0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
+	0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee,
+	0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
+	0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1,
+	0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
+	0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9,
+	0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
+	0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5,
+	0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
+	0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed,
+	0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
+	0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3,
+	0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
+	0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb,
+	0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
+	0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7,
+	0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
+	0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef,
+	0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff,
+};
+
+static void bitrev_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		dst[i] = reverse_table[src[i]];
+}
+
+#ifdef SIMD_X86
+/* Every byte is split to nibbles, each nibble is reversed by lookup in 16-byte table by pshufb
+ * and moved to opposite half of byte.
+ */
+__attribute__((target("ssse3")))
+static void bitrev_ssse3(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	// reversed low nibble placed to high half and reversed high nibble placed to low half
+	const __m128i lut_lo = _mm_setr_epi8(0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
+					     0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0);
+	const __m128i lut_hi = _mm_setr_epi8(0x00, 0x08, 0x04, 0x0c, 0x02, 0x0a, 0x06, 0x0e,
+					     0x01, 0x09, 0x05, 0x0d, 0x03, 0x0b, 0x07, 0x0f);
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(v, mask));
+		__m128i hi = _mm_shuffle_epi8(lut_hi, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(lo, hi));
+	}
+	bitrev_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void bitrev_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	// vpshufb works inside of 128-bit lanes, so both lanes have the same table
+	const __m256i lut_lo = _mm256_broadcastsi128_si256(
+		_mm_setr_epi8(0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
+			      0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0));
+	const __m256i lut_hi = _mm256_broadcastsi128_si256(
+		_mm_setr_epi8(0x00, 0x08, 0x04, 0x0c, 0x02, 0x0a, 0x06, 0x0e,
+			      0x01, 0x09, 0x05, 0x0d, 0x03, 0x0b, 0x07, 0x0f));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(v, mask));
+		__m256i hi = _mm256_shuffle_epi8(lut_hi,
+						 _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(lo, hi));
+	}
+	bitrev_ssse3(dst + i, src + i, len - i);
+}
+#endif
+
+#ifdef SIMD_NEON
+// AArch64 has instruction to reverse bits in every byte of vector
+static void bitrev_neon(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		vst1q_u8(dst + i, vrbitq_u8(vld1q_u8(src + i)));
+
+	bitrev_scalar(dst + i, src + i, len - i);
+}
+#endif
+
+static bool is_blank_scalar(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t v;
+
+		memcpy(&v, buf + i, 8);
+		if (v != ~(uint64_t)0)
+			return false;
+	}
+	for (; i < len; i++) {
+		if (buf[i] != 0xff)
+			return false;
+	}
+
+	return true;
+}
+
+#ifdef SIMD_X86
+// 64 bytes are combined by AND before compare, so loop has one branch per cache line
+__attribute__((target("sse2")))
+static bool is_blank_sse2(const uint8_t *buf, size_t len)
+{
+	const __m128i ones = _mm_set1_epi8((char)0xff);
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		__m128i v = _mm_and_si128(
+			_mm_and_si128(_mm_loadu_si128((const __m128i *)(buf + i)),
+				      _mm_loadu_si128((const __m128i *)(buf + i + 16))),
+			_mm_and_si128(_mm_loadu_si128((const __m128i *)(buf + i + 32)),
+				      _mm_loadu_si128((const __m128i *)(buf + i + 48))));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, ones)) != 0xffff)
+			return false;
+	}
+
+	return is_blank_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static bool is_blank_avx2(const uint8_t *buf, size_t len)
+{
+	const __m256i ones = _mm256_set1_epi8((char)0xff);
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		__m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(buf + i)),
+					     _mm256_loadu_si256((const __m256i *)(buf + i + 32)));
+
+		// carry flag of vptest is set if all bits of `ones` are set in `v`
+		if (!_mm256_testc_si256(v, ones))
+			return false;
+	}
+
+	return is_blank_scalar(buf + i, len - i);
+}
+#endif
+
+#ifdef SIMD_NEON
+static bool is_blank_neon(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		uint8x16_t v = vandq_u8(vandq_u8(vld1q_u8(buf + i), vld1q_u8(buf + i + 16)),
+					vandq_u8(vld1q_u8(buf + i + 32), vld1q_u8(buf + i + 48)));
+
+		if (vminvq_u8(v) != 0xff)
+			return false;
+	}
+
+	return is_blank_scalar(buf + i, len - i);
+}
+#endif
+
+static size_t diff_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		uint64_t va, vb;
+
+		memcpy(&va, a + i, 8);
+		memcpy(&vb, b + i, 8);
+		if (va != vb)
+			break;
+	}
+	while (i < len && a[i] == b[i])
+		i++;
+
+	return i;
+}
+
+#ifdef SIMD_X86
+// results of compare of 64 bytes are combined by AND, different byte is found by scalar code
+__attribute__((target("sse2")))
+static size_t diff_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		__m128i eq = _mm_and_si128(
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+						     _mm_loadu_si128((const __m128i *)(b + i))),
+				      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 16)),
+						     _mm_loadu_si128((const __m128i *)(b + i + 16)))),
+			_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 32)),
+						     _mm_loadu_si128((const __m128i *)(b + i + 32))),
+				      _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 48)),
+						     _mm_loadu_si128((const __m128i *)(b + i + 48)))));
+
+		if (_mm_movemask_epi8(eq) != 0xffff)
+			break;
+	}
+
+	return i + diff_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t diff_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		__m256i eq = _mm256_and_si256(
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+					  _mm256_loadu_si256((const __m256i *)(b + i))),
+			_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + 32)),
+					  _mm256_loadu_si256((const __m256i *)(b + i + 32))));
+
+		if (_mm256_movemask_epi8(eq) != -1)
+			break;
+	}
+
+	return i + diff_scalar(a + i, b + i, len - i);
+}
+#endif
+
+#ifdef SIMD_NEON
+static size_t diff_neon(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		uint8x16_t eq = vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i)),
+						  vceqq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16))),
+					 vandq_u8(vceqq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32)),
+						  vceqq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48))));
+
+		if (vminvq_u8(eq) != 0xff)
+			break;
+	}
+
+	return i + diff_scalar(a + i, b + i, len - i);
+}
+#endif
+
+static void (*bitrev_func)(uint8_t *dst, const uint8_t *src, size_t len) = bitrev_scalar;
+static bool (*is_blank_func)(const uint8_t *buf, size_t len) = is_blank_scalar;
+static size_t (*diff_func)(const uint8_t *a, const uint8_t *b, size_t len) = diff_scalar;
+
+// implementation is chosen once before main() by features of CPU
+__attribute__((constructor))
+static void simd_init(void)
+{
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		bitrev_func = bitrev_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		bitrev_func = bitrev_ssse3;
+
+	if (__builtin_cpu_supports("avx2"))
+		is_blank_func = is_blank_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		is_blank_func = is_blank_sse2;
+
+	if (__builtin_cpu_supports("avx2"))
+		diff_func = diff_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		diff_func = diff_sse2;
+#endif
+#ifdef SIMD_NEON
+	bitrev_func = bitrev_neon;
+	is_blank_func = is_blank_neon;
+	diff_func = diff_neon;
+#endif
+}
+
+/* Reverse order of bits in every byte of `src` and write result to `dst`. Buffers can be the
+ * same, but must not overlap partially.
+ */
+void simd_bitrev(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	bitrev_func(dst, src, len);
+}
+
+/* Return true if all bytes of `buf` are 0xff (erased state of flash).
+ */
+bool simd_is_blank(const uint8_t *buf, size_t len)
+{
+	return is_blank_func(buf, len);
+}
+
+/* Return position of the first byte that differs in `a` and `b`, or `len` if buffers are equal.
+ */
+size_t simd_diff(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	return diff_func(a, b, len);
+}
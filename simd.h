@@ -0,0 +1,14 @@
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bulk operations on buffers, vectorized implementation is chosen at runtime.
+
+void simd_bitrev(uint8_t *dst, const uint8_t *src, size_t len);
+bool simd_is_blank(const uint8_t *buf, size_t len);
+size_t simd_diff(const uint8_t *a, const uint8_t *b, size_t len);
+
+#endif
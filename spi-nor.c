@@ -1,18 +1,26 @@
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "common.h"
+#include "reader.h"
+#include "simd.h"
 #include "spi-nor.h"
 #include "spi.h"
 #include "usb.h"
+#include "writer.h"
 
 
 #define CMD_READ_ID		0x9f
 #define CMD_READ_STATUS		0x5
+#define CMD_READ_UID		0x4b
+#define CMD_READ_SFDP		0x5a
 
 #define CMD_READ		0x3
 #define CMD_FAST_READ		0xb
@@ -28,6 +36,34 @@
 #define CMD_ERASE_SECTOR_4BYTE	0xdc
 #define CMD_ERASE_4KSECTOR	0x20
 #define CMD_ERASE_4KSECTOR_4BYTE 0x21
+#define CMD_ERASE_32KBLOCK	0x52
+#define CMD_ERASE_32KBLOCK_4BYTE 0x5c
+#define CMD_ERASE_CHIP		0xc7
+#define CMD_ERASE_DIE		0xc4
+
+#define STATUS_BUSY		0x1
+
+#define T_PP_US			700     // typical page program time
+#define T_SE_4K_US		45000   // typical erase times
+#define T_SE_32K_US		120000
+#define T_SE_64K_US		150000
+#define T_CE_MIB_US		2500000 // typical chip erase time of 1 MiB
+#define T_CMD_US		10000   // USB transactions of one erase: start, status polls and end
+#define DIE_SIZE		(64 * MiB)  // die of multi-die flash
+#define POLL_CHUNK		31      // status bytes clocked by one poll, one SPI packet of CH341A
+#define POLL_INTERVAL_MAX_US	20000   // long erases are polled not more often than this
+#define REPORT_INTERVAL_US	100000  // progress of long operation is reported with this period
+#define BLANK_CHUNK		0x4000  // region is read by such parts to check if it is blank
+
+#define SFDP_SIGNATURE		0x50444653  // "SFDP" in little endian
+#define SFDP_HEADERS_MAX	16      // parameter headers are read not more than this
+#define SFDP_BFPT_ID		0xff00  // basic flash parameter table
+#define SFDP_SECTOR_MAP_ID	0xff81  // map of non-uniform sectors
+#define SFDP_ADDR4_ID		0xff84  // 4-byte address instruction table
+#define SFDP_BFPT_DWORDS	16      // parameters of JESD216B, later ones are not used
+#define SFDP_ADDR4_DWORDS	2
+#define SFDP_CACHE		"sfdp"
+#define SFDP_CACHE_LEN		256
 
 
 static uint32_t get_size_by_id2(uint8_t id2)
@@ -51,7 +87,11 @@ static bool spi_nor_id_fill_mt25q(struct spi_flash *flash, uint8_t *ids)
 		flash->name[5] = 'U';
 
 	mark = get_size_by_id2(ids[2]) >> 17;
+	// 1 Gb and larger parts are stacks of 512 Mb dies without bulk erase
 	if (mark >= 1024) {
+		flash->erase_chip.size = DIE_SIZE;
+		flash->erase_chip.cmd3 = CMD_ERASE_DIE;
+		flash->erase_chip.cmd4 = CMD_ERASE_DIE;
 		flash->name[6] = '0';
 		flash->name[7] = mark / 1024 + '0';
 		flash->name[8] = 'G';
@@ -169,11 +209,20 @@ static bool spi_nor_id_fill_s25fl(struct spi_flash *flash, uint8_t *ids)
 	return true;
 }
 
+#define ERASE_TYPE(_size, _cmd3, _cmd4, _time) \
+	{ .size = _size, .cmd3 = _cmd3, .cmd4 = _cmd4, .poll = { .expected_us = _time } }
+
+#define ERASE_4K  ERASE_TYPE(4 * KiB, CMD_ERASE_4KSECTOR, CMD_ERASE_4KSECTOR_4BYTE, T_SE_4K_US)
+#define ERASE_32K ERASE_TYPE(32 * KiB, CMD_ERASE_32KBLOCK, CMD_ERASE_32KBLOCK_4BYTE, T_SE_32K_US)
+#define ERASE_64K ERASE_TYPE(64 * KiB, CMD_ERASE_SECTOR, CMD_ERASE_SECTOR_4BYTE, T_SE_64K_US)
+
+// flash without erase_types erases only by erase_block, see spi_nor_set_erase_block()
 struct spi_flash spi_flashes[] = {
 	{
 		.name = "M25P",
 		.erase_block = 64 * KiB,
 		.page = 256,
+		.erase_types = { ERASE_64K },
 		.id_len = 1,
 		.ids = { 0x20 },
 		.fill_id_func = spi_nor_id_fill_m25p,
@@ -188,138 +237,470 @@ struct spi_flash spi_flashes[] = {
 		.name = "W25Q",
 		.erase_block = 64 * KiB,
 		.page = 256,
+		.erase_types = { ERASE_4K, ERASE_32K, ERASE_64K },
 		.id_len = 1,
 		.ids = { 0xEF },
 		.fill_id_func = spi_nor_id_fill_w25q,
+		// 4 dummy bytes before 64-bit unique ID
+		.uid_cmd = CMD_READ_UID,
+		.uid_skip = 4,
+		.uid_len = 8,
 	},
 	{
 		.name = "MT25Qxxxx",
 		.erase_block = 64 * KiB,
 		.page = 256,
+		.erase_types = { ERASE_4K, ERASE_32K, ERASE_64K },
 		.id_len = 1,
 		.ids = { 0x20 },
 		.fill_id_func = spi_nor_id_fill_mt25q,
+		// unique ID follows ID and length of extended ID
+		.uid_cmd = CMD_READ_ID,
+		.uid_skip = 4,
+		.uid_len = 16,
 	},
 };
 
-// this variable will be fill and return by spi_nor_init()
-static struct spi_flash flash_id;
+/* Fill `flash` with parameters of unknown flash.
+ */
+struct spi_flash *spi_nor_get_empty_flash(struct spi_flash *flash)
+{
+	memset(flash, 0, sizeof(*flash));
+	flash->name = strdup("Unknown");
+	flash->poll_program.expected_us = T_PP_US;
 
+	return flash;
+}
 
-struct spi_flash *spi_nor_get_empty_flash(void)
+/* Free memory allocated by spi_nor_init() or spi_nor_get_empty_flash().
+ */
+void spi_nor_release(struct spi_flash *flash)
 {
-	// free memory that was allocated by strdup() in previous call of spi_nor_init()
-	if (flash_id.name)
-		free(flash_id.name);
+	free(flash->name);
+	flash->name = NULL;
+}
 
-	flash_id.name = "Unknown";
+static bool spi_nor_cmd_send(struct usb_device *device, uint8_t cmd, uint8_t *data,
+			     unsigned data_len)
+{
+	struct spi_xfer xfers[] = {
+		{ .tx = &cmd, .len = 1, .flags = SPI_CS_ASSERT },
+		{ .tx = data, .len = data_len, .flags = SPI_CS_DEASSERT },
+	};
 
-	return &flash_id;
+	return spi_transaction(device, xfers, ARRAY_SIZE(xfers));
 }
 
-struct spi_flash *spi_nor_init(struct usb_device *device)
+static bool spi_nor_cmd_recv(struct usb_device *device, uint8_t cmd, uint8_t *data,
+			     unsigned data_len)
 {
-	uint8_t buf_out[sizeof(spi_flashes[0].ids) + 1];
-	uint8_t buf_in[sizeof(spi_flashes[0].ids) + 1];
-	bool found = false;
+	struct spi_xfer xfers[] = {
+		{ .tx = &cmd, .len = 1, .flags = SPI_CS_ASSERT },
+		{ .rx = data, .len = data_len, .flags = SPI_CS_DEASSERT },
+	};
 
-	buf_out[0] = CMD_READ_ID;
-	if (!spi_transfer(device, buf_out, buf_in, sizeof(buf_out)))
+	return spi_transaction(device, xfers, ARRAY_SIZE(xfers));
+}
+
+/* Read unique ID of chip by command from table of flashes. ID of erased or absent OTP area (all
+ * bytes 0x00 or 0xff) is not unique, it is not used.
+ */
+static bool spi_nor_read_uid(struct usb_device *device, struct spi_flash *flash)
+{
+	uint8_t buf[sizeof(flash->uid) + 8];
+	uint8_t *uid = buf + flash->uid_skip;
+	bool zeros = true, ones = true;
+
+	if (!flash->uid_len || flash->uid_skip + flash->uid_len > sizeof(buf) ||
+	    !spi_nor_cmd_recv(device, flash->uid_cmd, buf, flash->uid_skip + flash->uid_len))
 		return false;
 
-	// free memory that was allocated by strdup() in previous call of spi_nor_init()
-	if (flash_id.name)
-		free(flash_id.name);
+	for (int i = 0; i < flash->uid_len; i++) {
+		zeros = zeros && !uid[i];
+		ones = ones && uid[i] == 0xff;
+	}
+	memcpy(flash->uid, uid, flash->uid_len);
 
-	flash_id.name = "Unknown";
-	for (int i = 0; i < ARRAY_SIZE(spi_flashes); i++) {
-		if (!memcmp(spi_flashes[i].ids, buf_in + 1, spi_flashes[i].id_len)) {
-			memcpy(&flash_id, &spi_flashes[i], sizeof(flash_id));
-			flash_id.name = strdup(spi_flashes[i].name);
-			if (spi_flashes[i].fill_id_func) {
-				found = spi_flashes[i].fill_id_func(&flash_id, buf_in + 1);
-				if (found)
-					break;
+	return !zeros && !ones;
+}
 
-				free(flash_id.name);  // was allocated by strdup()
-			}
+// tables of SFDP (JESD216) used for parameters of flash, length is 0 if table is absent
+struct spi_nor_sfdp {
+	uint32_t bfpt[SFDP_BFPT_DWORDS];
+	unsigned bfpt_len;
+	uint32_t addr4[SFDP_ADDR4_DWORDS];
+	unsigned addr4_len;
+	bool sector_map;  // sizes of sectors are different in regions of chip
+};
+
+static bool spi_nor_sfdp_read_data(struct usb_device *device, uint32_t addr, uint8_t *buf,
+				   unsigned len)
+{
+	// 3-byte address and dummy byte
+	uint8_t cmd[] = { CMD_READ_SFDP, addr >> 16, addr >> 8, addr, 0 };
+	struct spi_xfer xfers[] = {
+		{ .tx = cmd, .len = sizeof(cmd), .flags = SPI_CS_ASSERT },
+		{ .rx = buf, .len = len, .flags = SPI_CS_DEASSERT },
+	};
+
+	return spi_transaction(device, xfers, ARRAY_SIZE(xfers));
+}
+
+/* Read table of parameter header `header` to `table` of `max` dwords.
+ * Return count of read dwords or -1 on error.
+ */
+static int spi_nor_sfdp_read_table(struct usb_device *device, uint8_t *header, uint32_t *table,
+				   unsigned max)
+{
+	uint32_t addr = header[4] | header[5] << 8 | header[6] << 16;
+	uint8_t buf[SFDP_BFPT_DWORDS * 4];
+	unsigned len = header[3];
+
+	if (len > max)
+		len = max;
+	if (!spi_nor_sfdp_read_data(device, addr, buf, len * 4))
+		return -1;
+
+	for (int i = 0; i < len; i++)
+		table[i] = buf[i * 4] | buf[i * 4 + 1] << 8 | buf[i * 4 + 2] << 16 |
+			   (uint32_t)buf[i * 4 + 3] << 24;
+
+	return len;
+}
+
+/* Read SFDP of chip. Chip without SFDP is not an error, then sfdp->bfpt_len is 0.
+ */
+static bool spi_nor_sfdp_read(struct usb_device *device, struct spi_nor_sfdp *sfdp)
+{
+	uint8_t buf[8 * (SFDP_HEADERS_MAX + 1)];
+	unsigned count;
+
+	memset(sfdp, 0, sizeof(*sfdp));
+	if (!spi_nor_sfdp_read_data(device, 0, buf, 8))
+		return false;
+	if ((buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24) != SFDP_SIGNATURE)
+		return true;
+
+	count = buf[6] + 1;
+	if (count > SFDP_HEADERS_MAX)
+		count = SFDP_HEADERS_MAX;
+	if (!spi_nor_sfdp_read_data(device, 8, buf + 8, count * 8))
+		return false;
+
+	for (int i = 1; i <= count; i++) {
+		uint8_t *header = buf + i * 8;
+		unsigned id = header[7] << 8 | header[0];
+		int len = 0;
+
+		// the last table of major revision 1 is the newest one
+		if (id == SFDP_BFPT_ID && header[2] == 1) {
+			len = spi_nor_sfdp_read_table(device, header, sfdp->bfpt, SFDP_BFPT_DWORDS);
+			sfdp->bfpt_len = len;
+		} else if (id == SFDP_ADDR4_ID) {
+			len = spi_nor_sfdp_read_table(device, header, sfdp->addr4, SFDP_ADDR4_DWORDS);
+			sfdp->addr4_len = len;
+		} else if (id == SFDP_SECTOR_MAP_ID) {
+			sfdp->sector_map = true;
 		}
+		if (len < 0)
+			return false;
 	}
-	flash_id.id_len = sizeof(flash_id.ids);
-	memcpy(flash_id.ids, buf_in + 1, sizeof(flash_id.ids));
-	if (!flash_id.size)
-		flash_id.size = get_size_by_id2(buf_in[3]);
 
-	return &flash_id;
+	return true;
 }
 
-static bool spi_nor_cmd_send(struct usb_device *device, uint8_t cmd, uint8_t *data,
-			     unsigned data_len)
+/* Tables are kept in cache as lists of hex dwords: "bfpt addr4 sector_map", "-" is empty list.
+ */
+static void spi_nor_sfdp_format(char *buf, uint32_t *table, unsigned len)
 {
-	uint8_t buf[data_len + 1];
+	if (!len)
+		strcpy(buf, "-");
+	for (int i = 0; i < len; i++)
+		buf += sprintf(buf, i ? ",%08x" : "%08x", table[i]);
+}
 
-	buf[0] = cmd;
-	memcpy(buf + 1, data, data_len);
-	return spi_transfer(device, buf, NULL, data_len + 1);
+static char *spi_nor_sfdp_parse(char *str, uint32_t *table, unsigned *len, unsigned max)
+{
+	*len = 0;
+	if (*str == '-')
+		return str + 1;
+
+	while (*len < max) {
+		char *end;
+
+		table[(*len)++] = strtoul(str, &end, 16);
+		if (end == str)
+			return NULL;
+		str = end;
+		if (*str != ',')
+			break;
+		str++;
+	}
+
+	return str;
 }
 
-static bool spi_nor_cmd_recv(struct usb_device *device, uint8_t cmd, uint8_t *data,
-			     unsigned data_len)
+static bool spi_nor_sfdp_load(const char *key, struct spi_nor_sfdp *sfdp)
 {
-	uint8_t buf[data_len + 1];
-	bool ret;
+	char value[SFDP_CACHE_LEN];
+	char *str;
 
-	buf[0] = cmd;
-	ret = spi_transfer(device, buf, buf, data_len + 1);
-	memcpy(data, buf + 1, data_len);
+	memset(sfdp, 0, sizeof(*sfdp));
+	if (!cache_get(SFDP_CACHE, key, value, sizeof(value)))
+		return false;
 
-	return ret;
+	str = spi_nor_sfdp_parse(value, sfdp->bfpt, &sfdp->bfpt_len, SFDP_BFPT_DWORDS);
+	if (!str || *str++ != ' ')
+		return false;
+	str = spi_nor_sfdp_parse(str, sfdp->addr4, &sfdp->addr4_len, SFDP_ADDR4_DWORDS);
+	if (!str || *str++ != ' ')
+		return false;
+	sfdp->sector_map = *str == '1';
+
+	return true;
 }
 
-bool spi_nor_custom(struct usb_device *device, uint8_t *tx, uint32_t tx_len,
-		    uint8_t *rx, uint32_t rx_len, bool duplex)
+static void spi_nor_sfdp_save(const char *key, struct spi_nor_sfdp *sfdp)
 {
-	uint32_t len;
-	bool ret = true;
+	char value[SFDP_CACHE_LEN];
+	char *str = value;
 
-	if (!spi_cs(device, true))
-		return false;
+	spi_nor_sfdp_format(str, sfdp->bfpt, sfdp->bfpt_len);
+	str += strlen(str);
+	*str++ = ' ';
+	spi_nor_sfdp_format(str, sfdp->addr4, sfdp->addr4_len);
+	str += strlen(str);
+	sprintf(str, " %u", sfdp->sector_map);
 
-	if (duplex && tx_len && rx_len) {
-		// If rx_len < tx_len in duplex mode then we need fill rx in first transaction
-		len = min(tx_len, rx_len);
-		ret = spi_transfer_nocs(device, tx, rx, len);
-		if (!ret) {
-			spi_cs(device, false);
-			return false;
+	cache_set(SFDP_CACHE, key, value);
+}
+
+// command with 4-byte address for erase command of chip without 4-byte address table
+static uint8_t spi_nor_sfdp_cmd4(uint8_t cmd3)
+{
+	switch (cmd3) {
+	case CMD_ERASE_4KSECTOR:
+		return CMD_ERASE_4KSECTOR_4BYTE;
+	case CMD_ERASE_32KBLOCK:
+		return CMD_ERASE_32KBLOCK_4BYTE;
+	case CMD_ERASE_SECTOR:
+		return CMD_ERASE_SECTOR_4BYTE;
+	default:
+		return 0;
+	}
+}
+
+/* Fill erase types of `flash` from SFDP. 4 KiB erase is used only if it is uniform, erase types
+ * of chip with sector map are valid only for some regions, so only the largest one is taken.
+ */
+static void spi_nor_sfdp_erase_types(struct spi_flash *flash, struct spi_nor_sfdp *sfdp)
+{
+	static const uint32_t units_ms[] = { 1, 16, 128, 1000 };
+	struct spi_nor_erase_type types[SPI_NOR_ERASE_TYPES] = {};
+	uint32_t *bfpt = sfdp->bfpt;
+	int count = 0;
+
+	for (int i = 0; i < SPI_NOR_ERASE_TYPES; i++) {
+		uint16_t field = bfpt[7 + i / 2] >> (i % 2 * 16);
+		unsigned shift = field & 0xff;
+		struct spi_nor_erase_type type = { .cmd3 = field >> 8 };
+		int pos;
+
+		if (shift < 8 || shift > 30)
+			continue;
+		type.size = 1 << shift;
+		if ((flash->size && type.size > flash->size) || (type.size == 4 * KiB && (bfpt[0] & 0x3) != 1))
+			continue;
+
+		if (sfdp->addr4_len == SFDP_ADDR4_DWORDS && (sfdp->addr4[0] & BIT(9 + i)))
+			type.cmd4 = sfdp->addr4[1] >> (i * 8);
+		else
+			type.cmd4 = spi_nor_sfdp_cmd4(type.cmd3);
+		if (flash->size > 16 * MiB && !type.cmd4)
+			continue;
+
+		// typical time is count and units, maximum time is not used
+		if (sfdp->bfpt_len >= 10) {
+			unsigned time = bfpt[9] >> (4 + i * 7);
+
+			type.poll.expected_us = ((time & 0x1f) + 1) * units_ms[(time >> 5) & 0x3] * 1000;
+		} else if (type.size <= 4 * KiB) {
+			type.poll.expected_us = T_SE_4K_US;
+		} else if (type.size <= 32 * KiB) {
+			type.poll.expected_us = T_SE_32K_US;
+		} else {
+			type.poll.expected_us = (uint64_t)T_SE_64K_US * type.size / (64 * KiB);
 		}
-		tx_len -= len;
-		rx_len -= len;
-		tx += len;
-		rx += len;
-	}
-	if (tx_len) {
-		ret = spi_transfer_nocs(device, tx, NULL, tx_len);
-		if (!ret) {
-			spi_cs(device, false);
-			return false;
+
+		// insert sorted by size, the same size is erased by the first command
+		for (pos = count; pos > 0 && types[pos - 1].size > type.size; pos--)
+			;
+		if (pos > 0 && types[pos - 1].size == type.size)
+			continue;
+		memmove(types + pos + 1, types + pos, (count - pos) * sizeof(types[0]));
+		types[pos] = type;
+		count++;
+	}
+	if (!count)
+		return;
+
+	if (sfdp->sector_map) {
+		types[0] = types[count - 1];
+		memset(types + 1, 0, sizeof(types) - sizeof(types[0]));
+		count = 1;
+	}
+	memcpy(flash->erase_types, types, sizeof(types));
+
+	// erase block of table is kept if chip supports it, else 64 KiB or the largest erase
+	for (int i = 0; i < count; i++) {
+		if (types[i].size == flash->erase_block)
+			return;
+	}
+	flash->erase_block = types[count - 1].size;
+	for (int i = 0; i < count; i++) {
+		if (types[i].size == 64 * KiB)
+			flash->erase_block = 64 * KiB;
+	}
+}
+
+/* Fill parameters of `flash` from basic flash parameter table: size, erase types and their
+ * typical times, page and its program time. Parameters absent in table are kept.
+ * Return typical time of chip erase or 0 if it is unknown.
+ */
+static uint64_t spi_nor_sfdp_apply(struct spi_flash *flash, struct spi_nor_sfdp *sfdp)
+{
+	static const uint32_t units_ms[] = { 16, 256, 4000, 64000 };
+	uint32_t *bfpt = sfdp->bfpt;
+	uint64_t bits;
+	unsigned time;
+
+	if (sfdp->bfpt_len < 9)
+		return 0;
+
+	// density is count of bits minus one or power of two of bits
+	if (bfpt[1] & BIT(31))
+		bits = (bfpt[1] & 0x7fffffff) < 35 ? 1ULL << (bfpt[1] & 0x7fffffff) : 0;
+	else
+		bits = (uint64_t)bfpt[1] + 1;
+	if (bits >= 8 * KiB * 8 && bits <= 2ULL * GiB * 8)
+		flash->size = bits / 8;
+
+	spi_nor_sfdp_erase_types(flash, sfdp);
+	flash->sfdp = true;
+	if (sfdp->bfpt_len < 11)
+		return 0;
+
+	if ((bfpt[10] >> 4) & 0xf)
+		flash->page = 1 << ((bfpt[10] >> 4) & 0xf);
+	time = bfpt[10] >> 8;
+	flash->poll_program.expected_us = ((time & 0x1f) + 1) * (time & BIT(5) ? 64 : 8);
+	time = bfpt[10] >> 24;
+
+	return (uint64_t)((time & 0x1f) + 1) * units_ms[(time >> 5) & 0x3] * 1000;
+}
+
+/* Get SFDP of chip with ID `ids`. SFDP of the same chip is the same, so it is read once and
+ * then taken from cache. Extended ID is part of key, it differs for chips with different
+ * sectors and the same JEDEC ID.
+ */
+static bool spi_nor_sfdp_get(struct usb_device *device, uint8_t *ids, struct spi_nor_sfdp *sfdp)
+{
+	char key[6 * 2 + 1];
+
+	for (int i = 0; i < 6; i++)
+		sprintf(key + i * 2, "%02x", ids[i]);
+	if (spi_nor_sfdp_load(key, sfdp))
+		return true;
+
+	if (!spi_nor_sfdp_read(device, sfdp))
+		return false;
+	// absence of SFDP is not cached, it can be also missed signature of badly connected chip
+	if (sfdp->bfpt_len)
+		spi_nor_sfdp_save(key, sfdp);
+
+	return true;
+}
+
+/* Detect flash connected to `device` and fill `flash` with its parameters. `flash` must be
+ * released by spi_nor_release().
+ * Return false if failed to read ID of flash.
+ */
+bool spi_nor_init(struct usb_device *device, struct spi_flash *flash)
+{
+	uint8_t buf_out[sizeof(spi_flashes[0].ids) + 1];
+	uint8_t buf_in[sizeof(spi_flashes[0].ids) + 1];
+	struct spi_nor_sfdp sfdp;
+	uint64_t chip_us = 0;
+	bool found = false;
+
+	buf_out[0] = CMD_READ_ID;
+	if (!spi_transfer(device, buf_out, buf_in, sizeof(buf_out)))
+		return false;
+
+	spi_nor_get_empty_flash(flash);
+	for (int i = 0; i < ARRAY_SIZE(spi_flashes); i++) {
+		if (!memcmp(spi_flashes[i].ids, buf_in + 1, spi_flashes[i].id_len)) {
+			free(flash->name);
+			memcpy(flash, &spi_flashes[i], sizeof(*flash));
+			flash->name = strdup(spi_flashes[i].name);
+			if (spi_flashes[i].fill_id_func) {
+				found = spi_flashes[i].fill_id_func(flash, buf_in + 1);
+				if (found)
+					break;
+			}
 		}
 	}
-	if (rx_len) {
-		ret = spi_transfer_nocs(device, NULL, rx, rx_len);
+	// parameters of last matched manufacturer are kept, but model is not known
+	if (!found) {
+		free(flash->name);
+		flash->name = strdup("Unknown");
 	}
+	flash->cs = device->cs;
+	flash->poll_program.expected_us = T_PP_US;
+	if (!flash->erase_types[0].size)
+		spi_nor_set_erase_block(flash, flash->erase_block);
+	flash->id_len = sizeof(flash->ids);
+	memcpy(flash->ids, buf_in + 1, sizeof(flash->ids));
+	if (!flash->size)
+		flash->size = get_size_by_id2(buf_in[3]);
+
+	// parameters of chip itself are preferred to table, name and quirks are kept from table
+	if (spi_nor_sfdp_get(device, flash->ids, &sfdp))
+		chip_us = spi_nor_sfdp_apply(flash, &sfdp);
+
+	spi_nor_set_size(flash, flash->size);
+	if (chip_us && flash->size)
+		flash->erase_chip.poll.expected_us = chip_us * flash->erase_chip.size / flash->size;
+
+	// unique ID is read by command of manufacturer, model can be unknown
+	if (!spi_nor_read_uid(device, flash))
+		flash->uid_len = 0;
 
-	ret = ret && spi_cs(device, false);
+	return true;
+}
 
-	return ret;
+bool spi_nor_custom(struct usb_device *device, uint8_t *tx, uint32_t tx_len,
+		    uint8_t *rx, uint32_t rx_len, bool duplex)
+{
+	// If rx_len < tx_len in duplex mode then we need fill rx in first part
+	uint32_t len = duplex ? min(tx_len, rx_len) : 0;
+	struct spi_xfer xfers[] = {
+		{ .tx = tx, .rx = rx, .len = len, .flags = SPI_CS_ASSERT },
+		{ .tx = tx ? tx + len : NULL, .len = tx_len - len },
+		{ .rx = rx ? rx + len : NULL, .len = rx_len - len, .flags = SPI_CS_DEASSERT },
+	};
+
+	return spi_transaction(device, xfers, ARRAY_SIZE(xfers));
 }
 
-static bool spi_nor_send_cmd_addr(struct usb_device *device, struct spi_flash *flash,
-				  uint8_t cmd3, uint8_t cmd4, uint32_t addr, unsigned dummy_count)
+/* Write command, address (3 or 4 bytes by size of flash) and `dummy_count` dummy bytes to `buf`.
+ * Return length of command.
+ */
+static unsigned spi_nor_fill_cmd_addr(struct spi_flash *flash, uint8_t *buf, uint8_t cmd3,
+				      uint8_t cmd4, uint32_t addr, unsigned dummy_count)
 {
 	uint8_t cmd;
 	unsigned addr_count;
-	uint8_t buf[dummy_count + 5];
 
 	if (flash->size > 16 * MiB) {
 		addr_count = 4;
@@ -335,99 +716,380 @@ static bool spi_nor_send_cmd_addr(struct usb_device *device, struct spi_flash *f
 
 	memset(buf + 1 + addr_count, 0xff, dummy_count);
 
-	return spi_transfer_nocs(device, buf, NULL, 1 + addr_count + dummy_count);
+	return 1 + addr_count + dummy_count;
 }
 
-bool spi_nor_read(struct usb_device *device, struct spi_flash *flash,
-		  uint32_t offset, uint32_t len, uint8_t *buf, int fd, cb_progress progress)
+/* Read `len` bytes to `buf` or, if it is NULL, to `writer`.
+ */
+static bool spi_nor_read_blocks(struct usb_device *device, struct spi_flash *flash,
+				uint32_t offset, uint32_t len, uint8_t *buf, struct writer *writer,
+				cb_progress progress)
 {
+	uint8_t cmd[6];
 	uint32_t pos = 0;
 	uint32_t remain = len;
+	// command is sent together with first block
+	struct spi_xfer xfers[2] = { { .tx = cmd, .flags = SPI_CS_ASSERT } };
+	struct spi_xfer *first = xfers;
+	bool to_file = !buf;
+
+	xfers[0].len = spi_nor_fill_cmd_addr(flash, cmd, CMD_FAST_READ, CMD_FAST_READ_4BYTE,
+					     offset, 1);
+	do {
+		uint32_t block_len = min(remain, 16 * KiB);
+
+		if (progress) {
+			progress(pos, len);
+			pos += block_len;
+		}
+		remain -= block_len;
+		xfers[1].rx = to_file ? writer_get(writer, block_len) : buf;
+		xfers[1].len = block_len;
+		xfers[1].flags = remain ? 0 : SPI_CS_DEASSERT;
+		if (!xfers[1].rx) {
+			// writing of previous blocks failed
+			spi_cs(device, false);
+			return false;
+		}
+		if (!spi_transaction(device, first, xfers + 2 - first))
+			return false;
+
+		first = &xfers[1];
+		if (!to_file)
+			buf += block_len;
+	} while (remain);
+
+	return true;
+}
+
+/* Read `len` bytes from `offset` to `buf` or, if it is NULL, to file `fd`.
+ */
+bool spi_nor_read(struct usb_device *device, struct spi_flash *flash,
+		  uint32_t offset, uint32_t len, uint8_t *buf, int fd, cb_progress progress)
+{
+	struct writer writer;
+	bool res;
+
+	if (buf)
+		return spi_nor_read_blocks(device, flash, offset, len, buf, NULL, progress);
+
+	// blocks are put directly to mapped file or written by separate thread
+	if (!writer_open(&writer, fd, len))
+		return false;
+
+	res = spi_nor_read_blocks(device, flash, offset, len, NULL, &writer, progress);
+
+	return writer_close(&writer, res) && res;
+}
+
+/* Read `len` bytes from `offset` to opened `writer`, so several reads share one output.
+ */
+bool spi_nor_read_to(struct usb_device *device, struct spi_flash *flash, uint32_t offset,
+		     uint32_t len, struct writer *writer, cb_progress progress)
+{
+	return spi_nor_read_blocks(device, flash, offset, len, NULL, writer, progress);
+}
+
+/* Read status register once and report if write or erase is still in progress.
+ */
+bool spi_nor_is_busy(struct usb_device *device, bool *busy)
+{
+	uint8_t status_reg;
 
-	if (!spi_cs(device, true))
+	if (!spi_nor_cmd_recv(device, CMD_READ_STATUS, &status_reg, 1))
 		return false;
 
-	if (!spi_nor_send_cmd_addr(device, flash, CMD_FAST_READ, CMD_FAST_READ_4BYTE, offset, 1))
+	*busy = status_reg & STATUS_BUSY;
+
+	return true;
+}
+
+/* Read manufacturer ID and report if flash is connected. Lines of disconnected flash are read
+ * as all zeros or all ones.
+ */
+bool spi_nor_is_present(struct usb_device *device, bool *present)
+{
+	uint8_t id;
+
+	if (!spi_nor_cmd_recv(device, CMD_READ_ID, &id, 1))
 		return false;
 
-	if (buf) {
-		while (remain) {
-			uint32_t block_len = min(remain, 16 * KiB);
+	*present = id != 0x00 && id != 0xff;
 
-			if (progress) {
-				progress(pos, len);
-				pos += block_len;
-			}
-			remain -= block_len;
-			if (!spi_transfer_nocs(device, NULL, buf, block_len))
-				return false;
+	return true;
+}
 
-			buf += block_len;
-		}
-	} else {
-		uint8_t local_buf[16 * KiB];
+static uint64_t spi_nor_now_us(void)
+{
+	struct timespec ts;
 
-		while (remain) {
-			uint32_t block_len = min(remain, 16 * KiB);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-			if (progress) {
-				progress(pos, len);
-				pos += block_len;
-			}
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-			remain -= block_len;
-			if (!spi_transfer_nocs(device, NULL, local_buf, block_len))
-				return false;
+static void spi_nor_sleep_us(uint64_t us)
+{
+	struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = us % 1000000 * 1000 };
 
-			if (write(fd, local_buf, block_len) == -1) {
-				spi_cs(device, false);
-				return false;
-			}
+	nanosleep(&ts, NULL);
+}
+
+// progress of long operation reported while it is waited, see spi_nor_wait_ready()
+struct spi_nor_report {
+	cb_progress progress;
+	uint32_t pos;    // work done before operation
+	uint32_t size;   // work done by operation
+	uint32_t total;
+};
+
+/* Report part of operation done by `elapsed` time by expected time of operation.
+ */
+static void spi_nor_report(struct spi_nor_report *report, uint64_t elapsed, uint64_t expected)
+{
+	uint64_t done = report->size;
+
+	if (!report->progress)
+		return;
+
+	// operation can take longer than expected, so its end is not reported before real end
+	if (elapsed < expected)
+		done = elapsed * report->size / expected;
+	report->progress(report->pos + min(done, report->size - report->size / 32), report->total);
+}
+
+/* Wait for end of write or erase started at `start` and disable write.
+ * Flash does not finish operation before expected time, so first poll is done at this time. Then
+ * CS is kept asserted and flash outputs status register continuously: every poll only clocks
+ * next POLL_CHUNK status bytes. Interval between polls grows with time of operation, so long
+ * erases do not load USB. Expected time is learned from previous operations of the same kind.
+ * report - if not NULL then progress of operation is reported by elapsed and expected time.
+ */
+static bool spi_nor_wait_ready(struct usb_device *device, struct spi_nor_poll *poll,
+			       uint64_t start, struct spi_nor_report *report)
+{
+	uint8_t cmd = CMD_READ_STATUS;
+	uint8_t write_disable = CMD_WRITE_DISABLE;
+	uint8_t status[POLL_CHUNK];
+	struct spi_xfer xfers[] = {
+		{ .tx = &cmd, .len = 1, .flags = SPI_CS_ASSERT },
+		{ .rx = status, .len = POLL_CHUNK },
+	};
+	struct spi_xfer xfers_end[] = {
+		{ .flags = SPI_CS_DEASSERT },
+		{ .tx = &write_disable, .len = 1, .flags = SPI_CS_ASSERT | SPI_CS_DEASSERT },
+	};
+	struct spi_xfer *first = xfers;
+	uint64_t last_busy = 0;
+	uint64_t elapsed;
+	unsigned busy_polls = 0;
+	bool busy = true;
+
+	while ((elapsed = spi_nor_now_us() - start) < poll->expected_us) {
+		uint64_t sleep = poll->expected_us - elapsed;
+
+		if (report) {
+			spi_nor_report(report, elapsed, poll->expected_us);
+			sleep = min(sleep, REPORT_INTERVAL_US);
 		}
+		spi_nor_sleep_us(sleep);
 	}
 
-	return spi_cs(device, false);
+	while (busy) {
+		elapsed = spi_nor_now_us() - start;
+		if (!spi_transaction(device, first, xfers + 2 - first)) {
+			spi_cs(device, false);
+			return false;
+		}
+		first = &xfers[1];
+		poll->polls++;
+
+		// status is kept busy until the end, so only the last byte matters
+		busy = status[POLL_CHUNK - 1] & STATUS_BUSY;
+		if (busy) {
+			last_busy = elapsed;
+			busy_polls++;
+			if (report)
+				spi_nor_report(report, elapsed, poll->expected_us);
+			spi_nor_sleep_us(min(elapsed / 8, POLL_INTERVAL_MAX_US));
+		}
+	}
+	poll->ops++;
+
+	// approach real time from both sides: earlier if the first poll was late, later if not
+	if (!busy_polls)
+		poll->expected_us -= poll->expected_us / 8;
+	else if (last_busy > poll->expected_us)
+		poll->expected_us += (last_busy - poll->expected_us) / 4;
+
+	return spi_transaction(device, xfers_end, ARRAY_SIZE(xfers_end));
 }
 
-bool spi_nor_erase_block(struct usb_device *device, struct spi_flash *flash, uint32_t offset)
+/* Return index of erase type of erase_block or -1 if flash can not erase it.
+ */
+static int spi_nor_erase_block_type(struct spi_flash *flash)
 {
-	uint8_t status_reg;
+	for (int i = 0; i < SPI_NOR_ERASE_TYPES && flash->erase_types[i].size; i++) {
+		if (flash->erase_types[i].size == flash->erase_block)
+			return i;
+	}
+
+	return -1;
+}
+
+struct spi_nor_erase_type *spi_nor_get_erase_type(struct spi_flash *flash, int type)
+{
+	return type == SPI_NOR_ERASE_CHIP ? &flash->erase_chip : &flash->erase_types[type];
+}
+
+/* Send erase command of type `type` and return without waiting for its end.
+ */
+static bool spi_nor_erase_start(struct usb_device *device, struct spi_flash *flash,
+				uint32_t offset, int type)
+{
+	struct spi_nor_erase_type *erase = spi_nor_get_erase_type(flash, type);
+	uint8_t write_enable = CMD_WRITE_ENABLE;
+	uint8_t cmd[5] = { CMD_ERASE_CHIP };
+	struct spi_xfer xfers[] = {
+		{ .tx = &write_enable, .len = 1, .flags = SPI_CS_ASSERT | SPI_CS_DEASSERT },
+		{ .tx = cmd, .len = 1, .flags = SPI_CS_ASSERT | SPI_CS_DEASSERT },
+	};
+
+	// chip erase has no address
+	if (erase->cmd3 != CMD_ERASE_CHIP)
+		xfers[1].len = spi_nor_fill_cmd_addr(flash, cmd, erase->cmd3, erase->cmd4, offset,
+						     0);
+
+	return spi_transaction(device, xfers, ARRAY_SIZE(xfers));
+}
+
+/* Read region by parts and check if all its bytes are 0xff. Reading stops at the first part with
+ * data, so usually only first part of region is read. Reading also stops (region is reported as
+ * not blank) if reading of whole region is going to take longer than `limit_us`.
+ */
+static bool spi_nor_is_blank(struct usb_device *device, struct spi_flash *flash, uint32_t offset,
+			     uint32_t len, uint64_t limit_us, bool *blank)
+{
+	uint8_t *buf = usb_buf(device, USB_BUF_CHECK, min(len, BLANK_CHUNK));
+	uint64_t start = spi_nor_now_us();
+	uint32_t pos = 0;
 
-	if (!spi_nor_cmd_send(device, CMD_WRITE_ENABLE, NULL, 0))
+	if (!buf)
 		return false;
 
-	if (!spi_cs(device, true))
+	*blank = false;
+	if ((uint64_t)len * flash->read_ns / 1000 > limit_us)
+		return true;
+
+	*blank = true;
+	while (pos < len && *blank) {
+		uint32_t chunk = min(len - pos, BLANK_CHUNK);
+
+		if (!spi_nor_read(device, flash, offset + pos, chunk, buf, 0, NULL))
+			return false;
+		*blank = simd_is_blank(buf, chunk);
+		pos += chunk;
+
+		flash->read_ns = (spi_nor_now_us() - start) * 1000 / pos;
+		if (*blank && pos < len && (uint64_t)len * flash->read_ns / 1000 > limit_us)
+			*blank = false;
+	}
+
+	return true;
+}
+
+/* Check if erase of type `type` at `offset` is needed. It is not needed only if flash->skip_blank
+ * is set and region is already blank. Check is given up if read is slower than erase itself.
+ */
+static bool spi_nor_erase_needed(struct usb_device *device, struct spi_flash *flash,
+				 uint32_t offset, int type, bool *needed)
+{
+	struct spi_nor_erase_type *erase = spi_nor_get_erase_type(flash, type);
+	bool blank;
+
+	*needed = true;
+	if (!flash->skip_blank)
+		return true;
+
+	if (!spi_nor_is_blank(device, flash, offset, erase->size, erase->poll.expected_us, &blank))
 		return false;
 
-	if (!spi_nor_send_cmd_addr(device, flash, CMD_ERASE_SECTOR, CMD_ERASE_SECTOR_4BYTE,
-				   offset, 0))
+	if (blank) {
+		flash->blank_erases++;
+		*needed = false;
+	}
+
+	return true;
+}
+
+/* Erase by command of type `type` and wait for its end.
+ */
+static bool spi_nor_erase_type(struct usb_device *device, struct spi_flash *flash,
+			       uint32_t offset, int type, struct spi_nor_report *report)
+{
+	uint64_t start;
+	bool needed;
+
+	if (!spi_nor_erase_needed(device, flash, offset, type, &needed))
 		return false;
+	if (!needed)
+		return true;
 
-	if (!spi_cs(device, false))
+	if (!spi_nor_erase_start(device, flash, offset, type))
 		return false;
 
-	do {
-		if (!spi_nor_cmd_recv(device, CMD_READ_STATUS, &status_reg, 1))
-			return false;
-	} while (status_reg & 0x1);
+	start = spi_nor_now_us();
+
+	return spi_nor_wait_ready(device, &spi_nor_get_erase_type(flash, type)->poll, start,
+				  report);
+}
+
+/* Send erase command of erase_block and return without waiting for its end.
+ */
+bool spi_nor_erase_block_start(struct usb_device *device, struct spi_flash *flash, uint32_t offset)
+{
+	int type = spi_nor_erase_block_type(flash);
 
-	return spi_nor_cmd_send(device, CMD_WRITE_DISABLE, NULL, 0);
+	if (type < 0)
+		return false;
+
+	return spi_nor_erase_start(device, flash, offset, type);
 }
 
+bool spi_nor_erase_block(struct usb_device *device, struct spi_flash *flash, uint32_t offset)
+{
+	int type = spi_nor_erase_block_type(flash);
+
+	if (type < 0)
+		return false;
+
+	return spi_nor_erase_type(device, flash, offset, type, NULL);
+}
+
+/* Erase region aligned to the smallest erase type by commands chosen by spi_nor_erase_type_at().
+ */
 bool spi_nor_erase(struct usb_device *device, struct spi_flash *flash, uint32_t offset,
 		   uint32_t len, cb_progress progress)
 {
+	struct spi_nor_report report = { .progress = progress, .total = len };
 	uint32_t pos = 0;
 
 	while (pos < len) {
+		int type = spi_nor_erase_type_at(flash, offset + pos, offset + len);
+
 		if (progress) {
 			progress(pos, len);
 		}
 
-		if (!spi_nor_erase_block(device, flash, offset + pos))
+		if (type < 0)
 			return false;
 
-		pos += flash->erase_block;
+		report.pos = pos;
+		report.size = spi_nor_get_erase_type(flash, type)->size;
+		if (!spi_nor_erase_type(device, flash, offset + pos, type, &report))
+			return false;
+
+		pos += report.size;
 	}
 
 	return true;
@@ -437,84 +1099,270 @@ bool spi_nor_erase_smart(struct usb_device *device, struct spi_flash *flash, uin
 			 uint32_t len, cb_progress progress)
 {
 	uint8_t *buf_pre = NULL, *buf_post = NULL;
-	uint32_t size_pre = offset % flash->erase_block;
-	uint32_t size_post = flash->erase_block - ((offset + len) % flash->erase_block);
-	bool res;
+	uint32_t unit = flash->erase_types[0].size;
+	uint32_t size_pre, size_post;
 
-	if (size_post == flash->erase_block)
+	if (!unit)
+		return false;
+
+	// only data in the smallest erase units at ends of region is kept
+	size_pre = offset % unit;
+	size_post = unit - ((offset + len) % unit);
+	if (size_post == unit)
 		size_post = 0;
 
 	if (size_pre) {
-		buf_pre = (uint8_t *)malloc(size_pre);
-		if (!spi_nor_read(device, flash, offset - size_pre, size_pre, buf_pre, 0, NULL))
+		buf_pre = usb_buf(device, USB_BUF_PRE, size_pre);
+		if (!buf_pre ||
+		    !spi_nor_read(device, flash, offset - size_pre, size_pre, buf_pre, 0, NULL))
 			return false;
 	}
 	if (size_post) {
-		buf_post = (uint8_t *)malloc(size_post);
-		if (!spi_nor_read(device, flash, offset + len, size_post, buf_post, 0, NULL)) {
-			free(buf_post);
-			if (size_pre)
-				free(buf_pre);
-
+		buf_post = usb_buf(device, USB_BUF_POST, size_post);
+		if (!buf_post ||
+		    !spi_nor_read(device, flash, offset + len, size_post, buf_post, 0, NULL))
 			return false;
-		}
 	}
 	if (!spi_nor_erase(device, flash, offset - size_pre, len + size_pre + size_post,
-			   progress)) {
-		if (size_pre)
-			free(buf_pre);
-		if (size_post)
-			free(buf_post);
+			   progress))
+		return false;
 
+	if (size_pre && !spi_nor_program(device, flash, offset - size_pre, size_pre, NULL,
+					 buf_pre, 0, false, NULL))
 		return false;
-	}
 
-	if (size_pre) {
-		res = spi_nor_program(device, flash, offset - size_pre, size_pre, NULL,
-				      buf_pre, 0, false, NULL, NULL, NULL, 0);
-		free(buf_pre);
-		if (!res)
-			return false;
-	}
+	if (size_post)
+		return spi_nor_program_smart(device, flash, offset + len, size_post, NULL,
+					     buf_post, 0, false, NULL);
 
-	if (size_post) {
-		res = spi_nor_program_smart(device, flash, offset + len, size_post, NULL, buf_post,
-					    0, false, NULL, NULL, NULL);
-		free(buf_post);
-		return res;
+	return true;
+}
+
+/* Send page program command and return without waiting for its end. Data must not cross end of
+ * page.
+ */
+bool spi_nor_program_page_start(struct usb_device *device, struct spi_flash *flash,
+				uint32_t offset, uint8_t *buf, uint32_t buf_len)
+{
+	uint8_t write_enable = CMD_WRITE_ENABLE;
+	uint8_t cmd[5];
+	struct spi_xfer xfers[] = {
+		{ .tx = &write_enable, .len = 1, .flags = SPI_CS_ASSERT | SPI_CS_DEASSERT },
+		{ .tx = cmd, .flags = SPI_CS_ASSERT },
+		{ .tx = buf, .len = min(buf_len, flash->page), .flags = SPI_CS_DEASSERT },
+	};
+
+	xfers[1].len = spi_nor_fill_cmd_addr(flash, cmd, CMD_PAGE_PROGRAM, CMD_PAGE_PROGRAM_4BYTE,
+					     offset, 0);
+
+	return spi_transaction(device, xfers, ARRAY_SIZE(xfers));
+}
+
+/* Compare data with current content of flash `old` and return what is needed to write it.
+ */
+enum spi_nor_change spi_nor_classify(const uint8_t *old, const uint8_t *data, uint32_t len)
+{
+	enum spi_nor_change change = SPI_NOR_SAME;
+	uint32_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t o, d;
+
+		memcpy(&o, old + i, sizeof(o));
+		memcpy(&d, data + i, sizeof(d));
+		if (d & ~o)
+			return SPI_NOR_ERASE;
+		if (d != o)
+			change = SPI_NOR_PROGRAM;
+	}
+	for (; i < len; i++) {
+		if (data[i] & ~old[i])
+			return SPI_NOR_ERASE;
+		if (data[i] != old[i])
+			change = SPI_NOR_PROGRAM;
 	}
 
-	return true;
+	return change;
 }
 
 bool spi_nor_program_page_single(struct usb_device *device, struct spi_flash *flash,
 				 uint32_t offset, uint8_t *buf, uint32_t buf_len)
 {
-	uint8_t status_reg;
+	uint64_t start;
 
-	buf_len = min(buf_len, flash->page);
-	if (!spi_nor_cmd_send(device, CMD_WRITE_ENABLE, NULL, 0))
-		return false;
+	// programming of 0xff does not change erased flash
+	if (simd_is_blank(buf, min(buf_len, flash->page))) {
+		flash->blank_pages++;
+		return true;
+	}
 
-	if (!spi_cs(device, true))
+	if (!spi_nor_program_page_start(device, flash, offset, buf, buf_len))
 		return false;
 
-	if (!spi_nor_send_cmd_addr(device, flash, CMD_PAGE_PROGRAM, CMD_PAGE_PROGRAM_4BYTE,
-				   offset, 0))
-		return false;
+	start = spi_nor_now_us();
 
-	if (!spi_transfer_nocs(device, buf, NULL, buf_len))
-		return false;
+	return spi_nor_wait_ready(device, &flash->poll_program, start, NULL);
+}
 
-	if (!spi_cs(device, false))
+/* Read back `len` bytes programmed at `offset` and compare them with `data`. The first
+ * differing address is kept in flash->verify_addr, all differences are added to flash->mismatch.
+ */
+static bool spi_nor_verify(struct usb_device *device, struct spi_flash *flash, uint32_t offset,
+			   const uint8_t *data, uint32_t len)
+{
+	uint8_t *buf = usb_buf(device, USB_BUF_VERIFY, len);
+	size_t diff;
+
+	if (!buf || !spi_nor_read(device, flash, offset, len, buf, 0, NULL))
 		return false;
 
-	do {
-		if (!spi_nor_cmd_recv(device, CMD_READ_STATUS, &status_reg, 1))
+	diff = simd_diff(buf, data, len);
+	if (diff == len)
+		return true;
+
+	flash->verify_addr = offset + diff;
+	if (flash->mismatch)
+		mismatch_compare(flash->mismatch, offset, buf, data, len);
+	flash->verify_failed = true;
+	errno = EIO;
+
+	return false;
+}
+
+// erase block programmed with spi_flash.delta
+struct spi_nor_delta {
+	uint8_t *cur;    // content of block as it must be after programming
+	uint32_t block;  // address of block
+	uint32_t end;    // address after the last programmed data
+	bool loaded;
+	bool erased;     // flash is blank from `end` to end of block
+};
+
+/* Finish block of `delta`, count it if it is programmed without erase. If block was erased, then
+ * its old data after the last programmed data is restored.
+ */
+static bool spi_nor_delta_close(struct usb_device *device, struct spi_flash *flash,
+				struct spi_nor_delta *delta)
+{
+	uint32_t block_end = delta->block + flash->erase_block;
+
+	if (!delta->loaded)
+		return true;
+	delta->loaded = false;
+	if (!delta->erased) {
+		flash->kept_blocks++;
+		return true;
+	}
+
+	for (uint32_t addr = delta->end; addr < block_end;) {
+		uint32_t len = min(block_end - addr, flash->page - addr % flash->page);
+
+		if (!spi_nor_program_page_single(device, flash, addr, delta->cur + addr - delta->block,
+						 len))
+			return false;
+		addr += len;
+	}
+
+	return !flash->verify || delta->end == block_end ||
+	       spi_nor_verify(device, flash, delta->end, delta->cur + delta->end - delta->block,
+			      block_end - delta->end);
+}
+
+/* Program page at `addr`. If `delta` is not NULL then block of page is erased only if some bit
+ * must become 1: content of block is read at its first page, after erase part of block before
+ * `addr` is restored, the rest is restored by spi_nor_delta_close().
+ */
+static bool spi_nor_program_page_delta(struct usb_device *device, struct spi_flash *flash,
+				       struct spi_nor_delta *delta, uint32_t addr, uint8_t *data,
+				       uint32_t len)
+{
+	uint32_t block = addr & ~(flash->erase_block - 1);
+	uint8_t *old;
+
+	if (!delta)
+		return spi_nor_program_page_single(device, flash, addr, data, len);
+
+	if (!delta->loaded || delta->block != block) {
+		if (!spi_nor_delta_close(device, flash, delta))
+			return false;
+		delta->cur = usb_buf(device, USB_BUF_BLOCK, flash->erase_block);
+		if (!delta->cur ||
+		    !spi_nor_read(device, flash, block, flash->erase_block, delta->cur, 0, NULL))
+			return false;
+		delta->block = block;
+		delta->loaded = true;
+		delta->erased = false;
+	}
+	old = delta->cur + addr - block;
+
+	// after erase flash is blank from the end of programmed data
+	switch (delta->erased ? SPI_NOR_PROGRAM : spi_nor_classify(old, data, len)) {
+	case SPI_NOR_SAME:
+		flash->same_pages++;
+		delta->end = addr + len;
+		return true;
+	case SPI_NOR_ERASE:
+		if (!spi_nor_erase_block(device, flash, block))
+			return false;
+		delta->erased = true;
+		for (uint32_t pos = 0; pos < addr - block; pos += flash->page) {
+			if (!spi_nor_program_page_single(device, flash, block + pos, delta->cur + pos,
+							 min(addr - block - pos, flash->page)))
+				return false;
+		}
+		break;
+	case SPI_NOR_PROGRAM:
+		break;
+	}
+	memcpy(old, data, len);
+	delta->end = addr + len;
+
+	return spi_nor_program_page_single(device, flash, addr, data, len);
+}
+
+/* Program `len` bytes from `buf` or, if it is NULL, from `reader`. Data is taken by parts up to
+ * end of erase block, so erase of block knows all its data: region of block after end of file
+ * is kept. With flash->verify every part is read back right after it is programmed. Block of
+ * `delta` (if it is not NULL) is finished at the end.
+ */
+static bool spi_nor_program_from(struct usb_device *device, struct spi_flash *flash,
+				 uint32_t offset, uint32_t len, uint32_t *flashed_size, uint8_t *buf,
+				 struct reader *reader, bool need_erase, struct spi_nor_delta *delta,
+				 cb_progress progress)
+{
+	uint32_t pos = 0;
+
+	while (pos < len) {
+		uint32_t addr = offset + pos;
+		uint32_t chunk = min(len - pos, flash->erase_block - addr % flash->erase_block);
+		uint8_t *data = buf ? buf + pos : reader_get(reader, &chunk);
+
+		if (!data)
+			return false;
+		if (!chunk)
+			break;
+
+		// data of block around chunk is kept, so offset may be not aligned to block
+		if (need_erase && !delta && !spi_nor_erase_smart(device, flash, addr, chunk, NULL))
 			return false;
-	} while (status_reg & 0x1);
 
-	return spi_nor_cmd_send(device, CMD_WRITE_DISABLE, NULL, 0);
+		for (uint32_t done = 0; done < chunk; done += flash->page) {
+			if (progress)
+				progress(pos + done, len);
+
+			if (!spi_nor_program_page_delta(device, flash, delta, addr + done, data + done,
+							min(chunk - done, flash->page)))
+				return false;
+		}
+		if (flashed_size)
+			*flashed_size += chunk;
+		if (flash->verify && !spi_nor_verify(device, flash, addr, data, chunk))
+			return false;
+
+		pos += chunk;
+	}
+
+	return !delta || spi_nor_delta_close(device, flash, delta);
 }
 
 /* Flash data. Offset must be aligned to page size.
@@ -523,69 +1371,80 @@ bool spi_nor_program_page_single(struct usb_device *device, struct spi_flash *fl
  * flashed_size - will write to this variable count of flashed bytes.
  * buf - if not NULL then use data to flash from this buffer.
  * fd - if `buf` is NULL then read data from this file descriptor.
- * need_erase - if true then erase block before start write to it.
+ * need_erase - if true then erase block before start write to it, data of last block after end
+ *              of file is kept.
  * progress - callback to show progress bar.
- * read_data - if not NULL then allocate memory and store data that readed from fd.
- *             Can be used for data verification.
- * read_len - will write count of data that read to `read_data`.
- * read_data_buf_size - current allocated size of `read_data`.
  * Return true if success or false if failed.
  */
 bool spi_nor_program(struct usb_device *device, struct spi_flash *flash, uint32_t offset,
 		     uint32_t len, uint32_t *flashed_size, uint8_t *buf, int fd, bool need_erase,
-		     cb_progress progress, uint8_t **read_data, uint32_t *read_len,
-		     uint32_t read_data_buf_size)
+		     cb_progress progress)
 {
-	uint32_t block_len;
-	uint32_t pos = 0;
+	struct spi_nor_delta delta = { 0 };
+	struct reader reader;
+	bool res;
 
-	while (pos < len) {
-		if (progress) {
-			progress(pos, len);
-		}
+	if (!buf && !reader_open(&reader, fd, len))
+		return false;
+
+	res = spi_nor_program_from(device, flash, offset, len, flashed_size, buf, &reader,
+				   need_erase, need_erase && flash->delta ? &delta : NULL, progress);
+	if (!buf)
+		res = reader_close(&reader) && res;
 
-		if (need_erase && ((offset + pos) & (flash->erase_block - 1)) == 0) {
-			if (!spi_nor_erase_block(device, flash, offset + pos))
+	return res;
+}
+
+static bool spi_nor_program_smart_from(struct usb_device *device, struct spi_flash *flash,
+				       uint32_t offset, uint32_t len, uint32_t *flashed_size,
+				       uint8_t *buf, struct reader *reader, bool need_erase,
+				       cb_progress progress)
+{
+	struct spi_nor_delta delta_block = { 0 };
+	struct spi_nor_delta *delta = need_erase && flash->delta ? &delta_block : NULL;
+	uint32_t size_pre = offset % flash->page;
+
+	if (size_pre) {
+		uint32_t len_in_first_page = min(len, flash->page - size_pre);
+		uint8_t *data = buf;
+		uint8_t *buf_pre;
+
+		if (!buf) {
+			data = reader_get(reader, &len_in_first_page);
+			if (!data)
 				return false;
+			else if (!len_in_first_page)
+				return true;  // file is empty
 		}
 
-		block_len = min(len - pos, flash->page);
-		if (buf) {
-			if (!spi_nor_program_page_single(device, flash, offset + pos, buf + pos,
-							 block_len))
-				return false;
-		} else {
-			uint8_t local_buf[block_len];
-			int ret = read(fd, local_buf, block_len);
+		// only region of data is erased, so the rest of page is read after erase
+		if (need_erase && !delta &&
+		    !spi_nor_erase_smart(device, flash, offset, len_in_first_page, NULL))
+			return false;
 
-			if (ret == -1)
-				return false;
+		buf_pre = usb_buf(device, USB_BUF_DATA, flash->page);
+		if (!buf_pre ||
+		    !spi_nor_read(device, flash, offset - size_pre, flash->page, buf_pre, 0, NULL))
+			return false;
 
-			if (read_data) {
-				if (read_data_buf_size < *read_len + ret) {
-					read_data_buf_size += 65536;
-					*read_data = (uint8_t *)realloc(*read_data,
-									read_data_buf_size);
-					if (!*read_data)
-						return false;
-				}
-				memcpy(*read_data + *read_len, local_buf, ret);
-				*read_len += ret;
-			}
-			if (ret && !spi_nor_program_page_single(device, flash, offset + pos,
-								local_buf, ret))
-				return false;
+		memcpy(buf_pre + size_pre, data, len_in_first_page);
+		if (flashed_size)
+			*flashed_size = len_in_first_page;
 
-			if (flashed_size)
-				*flashed_size += ret;
+		if (!spi_nor_program_page_delta(device, flash, delta, offset - size_pre, buf_pre,
+						flash->page) ||
+		    (flash->verify && !spi_nor_verify(device, flash, offset - size_pre, buf_pre,
+						      flash->page)))
+			return false;
 
-			if (ret != block_len)
-				break;
-		}
-		pos += block_len;
+		len -= len_in_first_page;
+		offset += len_in_first_page;
+		if (buf)
+			buf += len_in_first_page;
 	}
 
-	return true;
+	return spi_nor_program_from(device, flash, offset, len, flashed_size, buf, reader,
+				    need_erase, delta, progress);
 }
 
 /* Flash data. If offset is not aligned to page size then restore data in page before offset.
@@ -594,79 +1453,265 @@ bool spi_nor_program(struct usb_device *device, struct spi_flash *flash, uint32_
  * flashed_size - will write to this variable count of flashed bytes.
  * buf - if not NULL then use data to flash from this buffer.
  * fd - if `buf` is NULL then read data from this file descriptor.
- * need_erase - if true then erase block before start write to it.
+ * need_erase - if true then erase block before start write to it, data of last block after end
+ *              of file is kept. With flash->delta block is read first and erased only if
+ *              data can not be written without erase.
  * progress - callback to show progress bar.
- * read_data - if not NULL then allocate memory and store data that readed from fd.
- *             Can be used for data verification.
- * read_len - will write count of data that read to `read_data`.
  * Return true if success or false if failed.
  */
 bool spi_nor_program_smart(struct usb_device *device, struct spi_flash *flash, uint32_t offset,
 			   uint32_t len, uint32_t *flashed_size, uint8_t *buf, int fd,
-			   bool need_erase, cb_progress progress, uint8_t **read_data,
-			   uint32_t *read_len)
+			   bool need_erase, cb_progress progress)
 {
-	uint32_t size_pre = offset % flash->page;
-	uint32_t read_data_buf_size = 65536;
-	int ret;
+	struct reader reader;
+	bool res;
 
 	if (flashed_size)
 		*flashed_size = 0;
 
-	if (!read_len)
-		read_data = NULL;
+	if (!buf && !reader_open(&reader, fd, len))
+		return false;
 
-	if (read_data) {
-		*read_data = (uint8_t *)malloc(read_data_buf_size);
-		if (!*read_data)
-			return false;
+	res = spi_nor_program_smart_from(device, flash, offset, len, flashed_size, buf, &reader,
+					 need_erase, progress);
+	if (!buf)
+		res = reader_close(&reader) && res;
+
+	return res;
+}
 
-		*read_len = 0;
+// state of one chip in spi_nor_multi_program()
+struct spi_nor_job {
+	struct spi_flash *flash;
+	uint32_t erase_pos;
+	uint32_t erase_end;
+	uint32_t program_pos;
+	bool busy;
+	struct spi_nor_poll *poll;  // statistics of operation in progress
+};
+
+/* Start next erase or program command of `job`. Return false if failed and set `done` if there
+ * is nothing to do.
+ */
+static bool spi_nor_job_next(struct usb_device *device, struct spi_nor_job *job, uint32_t offset,
+			     uint32_t len, uint8_t *buf, bool *done)
+{
+	struct spi_flash *flash = job->flash;
+	int type = spi_nor_erase_block_type(flash);
+	bool needed = true;
+
+	*done = false;
+	// skip blank erase blocks and pages, no command is sent to chip for them
+	while (type >= 0 && job->erase_pos < job->erase_end) {
+		if (!spi_nor_erase_needed(device, flash, job->erase_pos, type, &needed))
+			return false;
+		if (needed)
+			break;
+		job->erase_pos += flash->erase_block;
 	}
+	while (buf && job->erase_pos >= job->erase_end && job->program_pos < offset + len) {
+		uint32_t addr = job->program_pos;
+		uint32_t block_len = min(offset + len - addr, flash->page - addr % flash->page);
 
-	if (size_pre) {
-		uint8_t buf_pre[flash->page];
-		uint32_t len_in_first_page = min(len, flash->page - size_pre);
+		if (!simd_is_blank(buf + addr - offset, block_len))
+			break;
+		flash->blank_pages++;
+		job->program_pos += block_len;
+	}
 
-		if (!spi_nor_read(device, flash, offset - size_pre, flash->page, buf_pre, 0, NULL))
+	if (job->erase_pos < job->erase_end) {
+		if (!spi_nor_erase_block_start(device, flash, job->erase_pos))
 			return false;
 
-		if (need_erase &&
-		    !spi_nor_erase_block(device, flash, offset & ~(flash->erase_block - 1)))
+		job->erase_pos += flash->erase_block;
+		job->poll = &flash->erase_types[type].poll;
+	} else if (buf && job->program_pos < offset + len) {
+		uint32_t addr = job->program_pos;
+		uint32_t block_len = min(offset + len - addr, flash->page - addr % flash->page);
+
+		if (!spi_nor_program_page_start(device, flash, addr, buf + addr - offset, block_len))
 			return false;
 
-		if (!buf) {
-			ret = read(fd, buf_pre + size_pre, len_in_first_page);
-			if (ret == -1)
-				return false;
-			else if (ret == 0)
-				return true;  // file is empty
+		job->program_pos += block_len;
+		job->poll = &flash->poll_program;
+	} else {
+		*done = true;
+		return true;
+	}
+	job->busy = true;
+
+	return true;
+}
+
+/* Erase and/or program the same region of several chips connected to different CS lines of one
+ * converter. Erase and program time is spent by chip, not by USB, so while one chip is busy
+ * commands are sent to other chips.
+ * flashes - chips to program. Erase blocks of all chips must be aligned to `offset` and `len`.
+ * buf - data to program or NULL if region must be only erased.
+ * need_erase - erase blocks before program.
+ * Return true if success on all chips.
+ */
+bool spi_nor_multi_program(struct usb_device *device, struct spi_flash **flashes, int count,
+			   uint32_t offset, uint32_t len, uint8_t *buf, bool need_erase,
+			   cb_progress progress)
+{
+	struct spi_nor_job jobs[SPI_CS_COUNT];
+	uint64_t total = 0;
+	int active = count;
+	bool res = true;
+
+	if (count > SPI_CS_COUNT || (!buf && !need_erase))
+		return false;
+	// nothing to erase or program, also `total` of progress is not zero below
+	if (!len)
+		return true;
+
+	for (int i = 0; i < count; i++) {
+		jobs[i].flash = flashes[i];
+		jobs[i].erase_pos = offset & ~(flashes[i]->erase_block - 1);
+		jobs[i].erase_end = jobs[i].erase_pos;
+		if (need_erase)
+			jobs[i].erase_end += spi_nor_calc_erase_size(flashes[i], offset, len);
+		jobs[i].program_pos = offset;
+		jobs[i].busy = false;
+		total += (buf ? len : 0) + (need_erase ? len : 0);
+	}
+
+	while (active) {
+		uint64_t pos = 0;
 
-			if (read_data) {
-				memcpy(*read_data, buf_pre + size_pre, ret);
-				*read_len = (uint32_t)ret;
+		active = 0;
+		for (int i = 0; i < count; i++) {
+			struct spi_nor_job *job = &jobs[i];
+			bool done;
+
+			device->cs = job->flash->cs;
+			if (job->busy) {
+				if (!spi_nor_is_busy(device, &job->busy)) {
+					res = false;
+					break;
+				}
+				job->poll->polls++;
+				if (job->busy) {
+					active++;
+					continue;
+				}
+				job->poll->ops++;
 			}
-			if (flashed_size)
-				*flashed_size = ret;
-		} else
-			memcpy(buf_pre + size_pre, buf, len_in_first_page);
+			if (!spi_nor_job_next(device, job, offset, len, buf, &done)) {
+				res = false;
+				break;
+			}
+			if (!done)
+				active++;
+		}
+		if (!res)
+			break;
 
-		if (!spi_nor_program_page_single(device, flash, offset - size_pre, buf_pre,
-						 flash->page))
-			return false;
+		if (progress) {
+			for (int i = 0; i < count; i++) {
+				if (need_erase)
+					pos += min(jobs[i].erase_pos, offset + len) -
+					       min(offset, jobs[i].erase_pos);
+				if (buf)
+					pos += jobs[i].program_pos - offset;
+			}
+			progress(pos * 1000 / total, 1000);
+		}
+	}
 
-		len -= len_in_first_page;
-		offset += len_in_first_page;
-		if (buf)
-			buf += len_in_first_page;
+	for (int i = 0; i < count; i++) {
+		device->cs = jobs[i].flash->cs;
+		res = spi_nor_cmd_send(device, CMD_WRITE_DISABLE, NULL, 0) && res;
 	}
 
-	return spi_nor_program(device, flash, offset, len, flashed_size, buf, fd, need_erase,
-			       progress, read_data, read_len, read_data_buf_size);
+	return res;
 }
 
+/* Return size of region erased by spi_nor_erase_smart(): region aligned to the smallest erase
+ * type.
+ */
 uint32_t spi_nor_calc_erase_size(struct spi_flash *flash, uint32_t offset, uint32_t len)
 {
-	return ((offset + len - 1) | (flash->erase_block - 1)) -
-	       (offset & ~(flash->erase_block - 1)) + 1;
+	uint32_t unit = flash->erase_types[0].size;
+
+	return ((offset + len - 1) | (unit - 1)) - (offset & ~(unit - 1)) + 1;
+}
+
+/* Set erase block of flash, then only erase command of block is used (erase block is overridden
+ * or flash has no smaller erase commands).
+ */
+void spi_nor_set_erase_block(struct spi_flash *flash, uint32_t erase_block)
+{
+	memset(flash->erase_types, 0, sizeof(flash->erase_types));
+	flash->erase_block = erase_block;
+	if (!erase_block)
+		return;
+
+	flash->erase_types[0].size = erase_block;
+	flash->erase_types[0].cmd3 = CMD_ERASE_SECTOR;
+	flash->erase_types[0].cmd4 = CMD_ERASE_SECTOR_4BYTE;
+	flash->erase_types[0].poll.expected_us = (uint64_t)T_SE_64K_US * erase_block / (64 * KiB);
+}
+
+/* Set size of flash. Expected time of chip erase depends on it.
+ */
+void spi_nor_set_size(struct spi_flash *flash, uint32_t size)
+{
+	struct spi_nor_erase_type *chip = &flash->erase_chip;
+
+	flash->size = size;
+	if (!chip->cmd3) {
+		chip->cmd3 = CMD_ERASE_CHIP;
+		chip->cmd4 = CMD_ERASE_CHIP;
+	}
+	if (chip->cmd3 == CMD_ERASE_CHIP)
+		chip->size = size;
+
+	chip->poll.expected_us = (uint64_t)T_CE_MIB_US * chip->size / MiB;
+}
+
+/* Choose erase command for address `addr` of region that ends at `end`. Sizes of erase types are
+ * nested, so block of every type is erased the fastest either by its own command or by the
+ * fastest erase of its parts. The largest block that starts at `addr` and fits in region is
+ * taken, unless its parts are erased faster. This gives the minimum time of whole region by
+ * expected (learned) times of erase types and USB time of every command. The same way whole
+ * chip (or die) is erased by one command if it is faster than erase by blocks.
+ * Return index of erase type (SPI_NOR_ERASE_CHIP for chip erase) or -1 if `addr` is not
+ * aligned to the smallest type.
+ */
+int spi_nor_erase_type_at(struct spi_flash *flash, uint32_t addr, uint32_t end)
+{
+	struct spi_nor_erase_type *types = flash->erase_types;
+	struct spi_nor_erase_type *chip = &flash->erase_chip;
+	uint64_t best[SPI_NOR_ERASE_TYPES];  // the fastest erase of block of every type
+	bool split[SPI_NOR_ERASE_TYPES];     // block is erased faster by parts
+	int count;
+
+	for (count = 0; count < SPI_NOR_ERASE_TYPES && types[count].size; count++) {
+		best[count] = types[count].poll.expected_us + T_CMD_US;
+		split[count] = false;
+		if (count) {
+			uint64_t parts = best[count - 1] * (types[count].size / types[count - 1].size);
+
+			if (parts < best[count]) {
+				best[count] = parts;
+				split[count] = true;
+			}
+		}
+	}
+
+	if (count && chip->size && chip->size % types[count - 1].size == 0 &&
+	    !(addr % chip->size) && end - addr >= chip->size &&
+	    chip->poll.expected_us + T_CMD_US < best[count - 1] * (chip->size / types[count - 1].size))
+		return SPI_NOR_ERASE_CHIP;
+
+	for (int i = count - 1; i >= 0; i--) {
+		if (addr % types[i].size || end - addr < types[i].size || split[i])
+			continue;
+
+		return i;
+	}
+
+	return -1;
 }
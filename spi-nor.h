@@ -1,7 +1,34 @@
 #ifndef _SPI_NOR_H
 #define _SPI_NOR_H
 
+#include "mismatch.h"
 #include "usb.h"
+#include "writer.h"
+
+// status polling of one kind of operation (page program or erase)
+struct spi_nor_poll {
+	uint32_t expected_us;  // learned time from start of operation to its end
+	unsigned ops;          // count of finished operations
+	unsigned polls;        // count of status reads
+};
+
+#define SPI_NOR_ERASE_TYPES 4
+#define SPI_NOR_ERASE_CHIP  SPI_NOR_ERASE_TYPES  // index of spi_flash.erase_chip
+
+// change of flash content needed to write new data, see spi_nor_classify()
+enum spi_nor_change {
+	SPI_NOR_SAME,     // data is already in flash
+	SPI_NOR_PROGRAM,  // only 1 -> 0 bit transitions, program without erase is enough
+	SPI_NOR_ERASE,    // some bits must become 1, erase is needed
+};
+
+// one of erase commands of flash
+struct spi_nor_erase_type {
+	uint32_t size;             // 0 if type is not used
+	uint8_t cmd3;              // command with 3-byte address
+	uint8_t cmd4;              // command with 4-byte address
+	struct spi_nor_poll poll;  // expected_us is time of this erase
+};
 
 struct spi_flash {
 	char *name;
@@ -11,29 +38,67 @@ struct spi_flash {
 	uint32_t page;
 	uint32_t id_len;
 	uint8_t ids[16];
+	uint8_t cs;  // chip select line of converter
+	uint8_t uid_cmd;   // command to read unique ID of chip
+	uint8_t uid_skip;  // bytes received after command before unique ID
+	uint8_t uid_len;   // 0 if unique ID of chip is not known
+	uint8_t uid[16];
+	struct spi_nor_poll poll_program;
+	// sorted by size, every size is multiple of previous one, erase_block is one of them
+	struct spi_nor_erase_type erase_types[SPI_NOR_ERASE_TYPES];
+	// erase of whole chip or of one die of multi-die chip, size is 0 if it is not supported
+	struct spi_nor_erase_type erase_chip;
+	bool sfdp;              // parameters are taken from SFDP of chip
+	bool skip_blank;        // read region before erase and do not erase it if it is blank
+	uint32_t blank_pages;   // pages not programmed because data is all 0xff
+	uint32_t blank_erases;  // erase commands not sent because region is already blank
+	uint32_t read_ns;       // measured time of read of one byte by blank check, 0 if unknown
+	// with need_erase read erase block first and erase it only if some bit must become 1
+	bool delta;
+	uint32_t same_pages;    // pages not programmed because flash already contains data
+	uint32_t kept_blocks;   // erase blocks programmed without erase
+	// read back every erase block (or its part) right after it is programmed
+	bool verify;
+	bool verify_failed;     // data read back differs, program stops
+	uint32_t verify_addr;   // the first differing address
+	struct mismatch *mismatch;  // map of differences of failed block, can be NULL
 };
 
-struct spi_flash *spi_nor_get_empty_flash(void);
-struct spi_flash *spi_nor_init(struct usb_device *device);
+struct spi_flash *spi_nor_get_empty_flash(struct spi_flash *flash);
+void spi_nor_release(struct spi_flash *flash);
+bool spi_nor_init(struct usb_device *device, struct spi_flash *flash);
 bool spi_nor_read(struct usb_device *device, struct spi_flash *flash,
 		  uint32_t offset, uint32_t len, uint8_t *buf, int fd, cb_progress progress);
+bool spi_nor_read_to(struct usb_device *device, struct spi_flash *flash, uint32_t offset,
+		     uint32_t len, struct writer *writer, cb_progress progress);
 bool spi_nor_erase_block(struct usb_device *device, struct spi_flash *flash, uint32_t offset);
 bool spi_nor_erase(struct usb_device *device, struct spi_flash *flash, uint32_t offset,
 		   uint32_t len, cb_progress progress);
 bool spi_nor_erase_smart(struct usb_device *device, struct spi_flash *flash, uint32_t offset,
 			 uint32_t len, cb_progress progress);
+bool spi_nor_erase_block_start(struct usb_device *device, struct spi_flash *flash, uint32_t offset);
+bool spi_nor_program_page_start(struct usb_device *device, struct spi_flash *flash,
+				uint32_t offset, uint8_t *buf, uint32_t buf_len);
+bool spi_nor_is_busy(struct usb_device *device, bool *busy);
+bool spi_nor_is_present(struct usb_device *device, bool *present);
 bool spi_nor_program_page_single(struct usb_device *device, struct spi_flash *flash,
 				 uint32_t offset, uint8_t *buf, uint32_t buf_len);
 bool spi_nor_program(struct usb_device *device, struct spi_flash *flash, uint32_t offset,
 		     uint32_t len, uint32_t *flashed_size, uint8_t *buf, int fd, bool need_erase,
-		     cb_progress progress, uint8_t **read_data, uint32_t *read_len,
-		     uint32_t read_data_buf_size);
+		     cb_progress progress);
 bool spi_nor_program_smart(struct usb_device *device, struct spi_flash *flash, uint32_t offset,
 			   uint32_t len, uint32_t *flashed_size, uint8_t *buf, int fd,
-			   bool need_erase, cb_progress progress, uint8_t **read_data,
-			   uint32_t *read_len);
+			   bool need_erase, cb_progress progress);
 bool spi_nor_custom(struct usb_device *device, uint8_t *tx, uint32_t tx_len,
 		    uint8_t *rx, uint32_t rx_len, bool duplex);
+bool spi_nor_multi_program(struct usb_device *device, struct spi_flash **flashes, int count,
+			   uint32_t offset, uint32_t len, uint8_t *buf, bool need_erase,
+			   cb_progress progress);
 uint32_t spi_nor_calc_erase_size(struct spi_flash *flash, uint32_t offset, uint32_t len);
+void spi_nor_set_erase_block(struct spi_flash *flash, uint32_t erase_block);
+void spi_nor_set_size(struct spi_flash *flash, uint32_t size);
+int spi_nor_erase_type_at(struct spi_flash *flash, uint32_t addr, uint32_t end);
+struct spi_nor_erase_type *spi_nor_get_erase_type(struct spi_flash *flash, int type);
+enum spi_nor_change spi_nor_classify(const uint8_t *old, const uint8_t *data, uint32_t len);
 
 #endif
@@ -1,54 +1,24 @@
-/*
- * Protocol and defines from https://github.com/setarcos/ch341prog
- */
+#include <stddef.h>
+#include <string.h>
 
+#include "ch341a.h"
+#include "simd.h"
 #include "spi.h"
 #include "usb.h"
 
-#define CH341_PACKET_LENGTH    0x20
-#define CH341_MAX_PACKETS      256
-#define CH341_MAX_PACKET_LEN   (CH341_PACKET_LENGTH * CH341_MAX_PACKETS)
-
-#define CH341A_CMD_SET_OUTPUT  0xA1
-#define CH341A_CMD_IO_ADDR     0xA2
-#define CH341A_CMD_PRINT_OUT   0xA3
-#define CH341A_CMD_SPI_STREAM  0xA8
-#define CH341A_CMD_SIO_STREAM  0xA9
-#define CH341A_CMD_I2C_STREAM  0xAA
-#define CH341A_CMD_UIO_STREAM  0xAB
-
-#define CH341A_CMD_I2C_STM_STA 0x74
-#define CH341A_CMD_I2C_STM_STO 0x75
-#define CH341A_CMD_I2C_STM_OUT 0x80
-#define CH341A_CMD_I2C_STM_IN  0xC0
-#define CH341A_CMD_I2C_STM_MAX ( min( 0x3F, CH341_PACKET_LENGTH ) )
-#define CH341A_CMD_I2C_STM_SET 0x60
-#define CH341A_CMD_I2C_STM_US  0x40
-#define CH341A_CMD_I2C_STM_MS  0x50
-#define CH341A_CMD_I2C_STM_DLY 0x0F
-#define CH341A_CMD_I2C_STM_END 0x00
-
-#define CH341A_CMD_UIO_STM_IN  0x00
-#define CH341A_CMD_UIO_STM_DIR 0x40
-#define CH341A_CMD_UIO_STM_OUT 0x80
-#define CH341A_CMD_UIO_STM_US  0xC0
-#define CH341A_CMD_UIO_STM_END 0x20
-
-#define CH341A_STM_I2C_20K     0x00
-#define CH341A_STM_I2C_100K    0x01
-#define CH341A_STM_I2C_400K    0x02
-#define CH341A_STM_I2C_750K    0x03
-#define CH341A_STM_SPI_DBL     0x04
-
-bool spi_set_speed(struct usb_device *device, bool double_speed)
+#define SPI_PACKET_DATA (CH341_PACKET_LENGTH - 1)  // data bytes of one SPI stream command
+
+/* Set clock of SPI. `speed` is one of SPI_SPEED_COUNT settings of converter, 0 is the slowest.
+ */
+bool spi_set_speed(struct usb_device *device, unsigned speed, bool double_speed)
 {
 	uint8_t buf[3];
 
-	if (!device)
+	if (!device || speed >= SPI_SPEED_COUNT)
 		return false;
 
 	buf[0] = CH341A_CMD_I2C_STREAM;
-	buf[1] = CH341A_CMD_I2C_STM_SET;
+	buf[1] = CH341A_CMD_I2C_STM_SET | speed;
 	if (double_speed)
 		buf[1] |= CH341A_STM_SPI_DBL;
 	buf[2] = CH341A_CMD_I2C_STM_END;
@@ -56,111 +26,250 @@ bool spi_set_speed(struct usb_device *device, bool double_speed)
 	return usb_write(device, buf, 3);
 }
 
-bool spi_cs(struct usb_device *device, bool cs_assert)
+/* Commands of CH341A collected for one usb_stream() call. Every command starts from new USB
+ * packet of CH341_PACKET_LENGTH bytes. SPI stream command sends as many bytes as its packet
+ * carries, so short packet of SPI stream command must end OUT transfer (USB can not send short
+ * packet in the middle of transfer). UIO stream command is ended by END, so its packet is padded.
+ * Commands are stored with reversed bits: whole buffer is reversed before send, then commands are
+ * restored and data gets bit order of CH341A. Buffers are borrowed from device, so commands are
+ * built right in memory of USB transfers.
+ */
+struct spi_batch {
+	uint8_t *out;                     // USB_BUF_OUT of device
+	uint8_t *in;                      // USB_BUF_IN of device
+	int lens_out[CH341_MAX_PACKETS];  // lengths of OUT transfers
+	int count_out;
+	unsigned out_len;
+	unsigned transfer_start;          // start of current OUT transfer in `out`
+	unsigned in_len;
+	int lens_in[CH341_MAX_PACKETS];   // lengths of answers to SPI stream commands
+	int packets_in;
+	uint8_t *spi_packet;              // SPI stream command that is not full yet
+	unsigned spi_len;                 // count of data bytes in `spi_packet`
+	uint8_t *uio_packet;              // last command if it is UIO stream, it can be extended
+	unsigned uio_len;
+	struct spi_xfer *rx_xfer;         // received data is copied to this part of transaction
+	unsigned rx_pos;
+};
+
+static uint8_t rev(uint8_t c)
 {
-	uint8_t buf[4];
+	simd_bitrev(&c, &c, 1);
 
-	if (!device)
-		return false;
+	return c;
+}
 
-	buf[0] = CH341A_CMD_UIO_STREAM;
-	if (cs_assert) {
-		buf[1] = CH341A_CMD_UIO_STM_OUT | 0x36;
-		buf[2] = CH341A_CMD_UIO_STM_DIR | 0x3f;
-		buf[3] = CH341A_CMD_UIO_STM_END;
-	} else {
-		buf[1] = CH341A_CMD_UIO_STM_OUT | 0x37;
-		buf[2] = CH341A_CMD_UIO_STM_END;
+static void spi_batch_reset(struct spi_batch *batch)
+{
+	batch->count_out = 0;
+	batch->out_len = 0;
+	batch->transfer_start = 0;
+	batch->in_len = 0;
+	batch->packets_in = 0;
+	batch->spi_packet = NULL;
+	batch->uio_packet = NULL;
+}
+
+static void spi_batch_end_transfer(struct spi_batch *batch)
+{
+	if (batch->out_len > batch->transfer_start) {
+		batch->lens_out[batch->count_out++] = batch->out_len - batch->transfer_start;
+		batch->transfer_start = batch->out_len;
 	}
+}
+
+static void spi_batch_close_spi(struct spi_batch *batch)
+{
+	if (!batch->spi_packet)
+		return;
 
-	return usb_write(device, buf, cs_assert ? 4 : 3);
+	batch->out_len += batch->spi_len + 1;
+	batch->lens_in[batch->packets_in - 1] = batch->spi_len;
+	if (batch->spi_len < SPI_PACKET_DATA)
+		spi_batch_end_transfer(batch);
+
+	batch->spi_packet = NULL;
 }
 
-inline static uint8_t swap(uint8_t c)
+/* Send collected commands and copy received data to parts of transaction.
+ */
+static bool spi_batch_flush(struct usb_device *device, struct spi_batch *batch)
 {
-	static const uint8_t reverse_table[] = {
-		0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
-		0x10, 0x90, 0x50, 0xd0, 0x30, 0xb0, 0x70, 0xf0,
-		0x08, 0x88, 0x48, 0xc8, 0x28, 0xa8, 0x68, 0xe8,
-		0x18, 0x98, 0x58, 0xd8, 0x38, 0xb8, 0x78, 0xf8,
-		0x04, 0x84, 0x44, 0xc4, 0x24, 0xa4, 0x64, 0xe4,
-		0x14, 0x94, 0x54, 0xd4, 0x34, 0xb4, 0x74, 0xf4,
-		0x0c, 0x8c, 0x4c, 0xcc, 0x2c, 0xac, 0x6c, 0xec,
-		0x1c, 0x9c, 0x5c, 0xdc, 0x3c, 0xbc, 0x7c, 0xfc,
-		0x02, 0x82, 0x42, 0xc2, 0x22, 0xa2, 0x62, 0xe2,
-		0x12, 0x92, 0x52, 0xd2, 0x32, 0xb2, 0x72, 0xf2,
-		0x0a, 0x8a, 0x4a, 0xca, 0x2a, 0xaa, 0x6a, 0xea,
-		0x1a, 0x9a, 0x5a, 0xda, 0x3a, 0xba, 0x7a, 0xfa,
-		0x06, 0x86, 0x46, 0xc6, 0x26, 0xa6, 0x66, 0xe6,
-		0x16, 0x96, 0x56, 0xd6, 0x36, 0xb6, 0x76, 0xf6,
-		0x0e, 0x8e, 0x4e, 0xce, 0x2e, 0xae, 0x6e, 0xee,
-		0x1e, 0x9e, 0x5e, 0xde, 0x3e, 0xbe, 0x7e, 0xfe,
-		0x01, 0x81, 0x41, 0xc1, 0x21, 0xa1, 0x61, 0xe1,
-		0x11, 0x91, 0x51, 0xd1, 0x31, 0xb1, 0x71, 0xf1,
-		0x09, 0x89, 0x49, 0xc9, 0x29, 0xa9, 0x69, 0xe9,
-		0x19, 0x99, 0x59, 0xd9, 0x39, 0xb9, 0x79, 0xf9,
-		0x05, 0x85, 0x45, 0xc5, 0x25, 0xa5, 0x65, 0xe5,
-		0x15, 0x95, 0x55, 0xd5, 0x35, 0xb5, 0x75, 0xf5,
-		0x0d, 0x8d, 0x4d, 0xcd, 0x2d, 0xad, 0x6d, 0xed,
-		0x1d, 0x9d, 0x5d, 0xdd, 0x3d, 0xbd, 0x7d, 0xfd,
-		0x03, 0x83, 0x43, 0xc3, 0x23, 0xa3, 0x63, 0xe3,
-		0x13, 0x93, 0x53, 0xd3, 0x33, 0xb3, 0x73, 0xf3,
-		0x0b, 0x8b, 0x4b, 0xcb, 0x2b, 0xab, 0x6b, 0xeb,
-		0x1b, 0x9b, 0x5b, 0xdb, 0x3b, 0xbb, 0x7b, 0xfb,
-		0x07, 0x87, 0x47, 0xc7, 0x27, 0xa7, 0x67, 0xe7,
-		0x17, 0x97, 0x57, 0xd7, 0x37, 0xb7, 0x77, 0xf7,
-		0x0f, 0x8f, 0x4f, 0xcf, 0x2f, 0xaf, 0x6f, 0xef,
-		0x1f, 0x9f, 0x5f, 0xdf, 0x3f, 0xbf, 0x7f, 0xff,
-	};
+	unsigned pos = 0;
+	bool res;
+
+	spi_batch_close_spi(batch);
+	spi_batch_end_transfer(batch);
+	if (!batch->count_out)
+		return true;
 
-	return reverse_table[c];
+	simd_bitrev(batch->out, batch->out, batch->out_len);
+	res = usb_stream(device, batch->out, batch->lens_out, batch->count_out, batch->in,
+			 batch->lens_in, batch->packets_in);
+
+	// received bytes follow in order of parts, every part receives `len` bytes
+	while (res && pos < batch->in_len) {
+		struct spi_xfer *xfer = batch->rx_xfer;
+		unsigned len = min(xfer->len - batch->rx_pos, batch->in_len - pos);
+
+		if (xfer->rx)
+			simd_bitrev(xfer->rx + batch->rx_pos, batch->in + pos, len);
+
+		pos += len;
+		batch->rx_pos += len;
+		if (batch->rx_pos == xfer->len) {
+			batch->rx_xfer++;
+			batch->rx_pos = 0;
+		}
+	}
+	spi_batch_reset(batch);
+
+	return res;
 }
 
-bool spi_transfer_nocs(struct usb_device *device, uint8_t *data_out, uint8_t *data_in, unsigned len)
+/* Reserve packet for next command, send collected commands if buffer is full.
+ */
+static uint8_t *spi_batch_packet(struct usb_device *device, struct spi_batch *batch)
 {
-	uint8_t buf_in[CH341_PACKET_LENGTH];
-	uint8_t buf_out[CH341_PACKET_LENGTH];
-	unsigned packet_len;
+	spi_batch_close_spi(batch);
+	batch->uio_packet = NULL;
+	if (batch->out_len + CH341_PACKET_LENGTH > CH341_MAX_PACKET_LEN &&
+	    !spi_batch_flush(device, batch))
+		return NULL;
 
-	if (!device)
-		return false;
+	return batch->out + batch->out_len;
+}
 
-	buf_out[0] = CH341A_CMD_SPI_STREAM;
-	if (!data_out) {
-		packet_len = min(len, CH341_PACKET_LENGTH - 1);
-		for (int i = 0; i < packet_len; i++)
-			buf_out[i + 1] = 0xff;
+/* Add UIO stream commands. Consecutive UIO commands (e.g. deassert CS of one transfer and assert
+ * CS of next one) share one packet.
+ */
+static bool spi_batch_uio(struct usb_device *device, struct spi_batch *batch, const uint8_t *cmds,
+			  unsigned count)
+{
+	if (!batch->uio_packet || batch->uio_len + count + 1 > CH341_PACKET_LENGTH) {
+		uint8_t *packet = spi_batch_packet(device, batch);
+
+		if (!packet)
+			return false;
+
+		packet[0] = rev(CH341A_CMD_UIO_STREAM);
+		batch->uio_packet = packet;
+		batch->uio_len = 1;
+		batch->out_len += CH341_PACKET_LENGTH;
 	}
+	for (unsigned i = 0; i < count; i++)
+		batch->uio_packet[batch->uio_len++] = rev(cmds[i]);
+
+	batch->uio_packet[batch->uio_len] = rev(CH341A_CMD_UIO_STM_END);
+
+	return true;
+}
 
+/* Add `len` bytes of `tx` (or 0xff bytes if `tx` is NULL) to SPI stream commands.
+ */
+static bool spi_batch_data(struct usb_device *device, struct spi_batch *batch, const uint8_t *tx,
+			   unsigned len)
+{
 	while (len) {
-		packet_len = min(len, CH341_PACKET_LENGTH - 1);
-		len -= packet_len;
-		if (data_out) {
-			for (int i = 0; i < packet_len; i++)
-				buf_out[i + 1] = swap(*data_out++);
-		}
-		if (!usb_write(device, buf_out, packet_len + 1))
-			return false;
+		unsigned chunk;
 
-		if (!usb_read(device, buf_in, packet_len))
-			return false;
+		if (!batch->spi_packet) {
+			uint8_t *packet = spi_batch_packet(device, batch);
+
+			if (!packet)
+				return false;
 
-		if (data_in) {
-			for (int i = 0; i < packet_len; i++)
-				*data_in++ = swap(buf_in[i]);
+			packet[0] = rev(CH341A_CMD_SPI_STREAM);
+			batch->spi_packet = packet;
+			batch->spi_len = 0;
+			batch->packets_in++;
 		}
+		chunk = min(len, SPI_PACKET_DATA - batch->spi_len);
+		if (tx) {
+			memcpy(batch->spi_packet + 1 + batch->spi_len, tx, chunk);
+			tx += chunk;
+		} else
+			memset(batch->spi_packet + 1 + batch->spi_len, 0xff, chunk);
+
+		batch->spi_len += chunk;
+		batch->in_len += chunk;
+		len -= chunk;
+		// full packet does not end transfer
+		if (batch->spi_len == SPI_PACKET_DATA)
+			spi_batch_close_spi(batch);
 	}
 
 	return true;
 }
 
-bool spi_transfer(struct usb_device *device, uint8_t *data_out, uint8_t *data_in, unsigned len)
+/* Run list of parts of SPI transaction. CS toggles and data of all parts are sent together: up
+ * to CH341_MAX_PACKETS packets by one usb_stream() call, so USB round-trip is paid once per batch
+ * instead of once per command.
+ */
+bool spi_transaction(struct usb_device *device, struct spi_xfer *xfers, int count)
 {
-	if (!spi_cs(device, true))
+	struct spi_batch batch;
+	uint8_t cs_assert[2];
+	uint8_t cs_deassert[1];
+
+	if (!device || device->cs >= SPI_CS_COUNT)
 		return false;
 
-	if (!spi_transfer_nocs(device, data_out, data_in, len))
+	// CS lines are active low
+	cs_assert[0] = CH341A_CMD_UIO_STM_OUT | (0x37 & ~BIT(device->cs));
+	cs_assert[1] = CH341A_CMD_UIO_STM_DIR | 0x3f;
+	cs_deassert[0] = CH341A_CMD_UIO_STM_OUT | 0x37;
+
+	batch.out = usb_buf(device, USB_BUF_OUT, CH341_MAX_PACKET_LEN);
+	batch.in = usb_buf(device, USB_BUF_IN, CH341_MAX_PACKETS * SPI_PACKET_DATA);
+	if (!batch.out || !batch.in)
 		return false;
 
-	return spi_cs(device, false);
+	spi_batch_reset(&batch);
+	batch.rx_xfer = xfers;
+	batch.rx_pos = 0;
+	for (int i = 0; i < count; i++) {
+		if ((xfers[i].flags & SPI_CS_ASSERT) &&
+		    !spi_batch_uio(device, &batch, cs_assert, sizeof(cs_assert)))
+			return false;
+
+		if (!spi_batch_data(device, &batch, xfers[i].tx, xfers[i].len))
+			return false;
+
+		if ((xfers[i].flags & SPI_CS_DEASSERT) &&
+		    !spi_batch_uio(device, &batch, cs_deassert, sizeof(cs_deassert)))
+			return false;
+	}
+
+	return spi_batch_flush(device, &batch);
+}
+
+/* Assert or deassert chip select line device->cs. Other CS lines are kept deasserted.
+ */
+bool spi_cs(struct usb_device *device, bool cs_assert)
+{
+	struct spi_xfer xfer = { .flags = cs_assert ? SPI_CS_ASSERT : SPI_CS_DEASSERT };
+
+	return spi_transaction(device, &xfer, 1);
+}
+
+/* Transfer data without touching CS.
+ */
+bool spi_transfer_nocs(struct usb_device *device, uint8_t *data_out, uint8_t *data_in, unsigned len)
+{
+	struct spi_xfer xfer = { .tx = data_out, .rx = data_in, .len = len };
+
+	return spi_transaction(device, &xfer, 1);
+}
+
+bool spi_transfer(struct usb_device *device, uint8_t *data_out, uint8_t *data_in, unsigned len)
+{
+	struct spi_xfer xfer = {
+		.tx = data_out,
+		.rx = data_in,
+		.len = len,
+		.flags = SPI_CS_ASSERT | SPI_CS_DEASSERT,
+	};
+
+	return spi_transaction(device, &xfer, 1);
 }
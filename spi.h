@@ -6,15 +6,30 @@
 
 #include "usb.h"
 
+#define SPI_CS_COUNT 3  // CS0-CS2 lines of CH341A (D0-D2 pins)
+#define SPI_SPEED_COUNT 4  // clock settings of CH341A (bits 1:0 of stream mode)
+
+#define SPI_CS_ASSERT   BIT(0)  // assert CS before data of part
+#define SPI_CS_DEASSERT BIT(1)  // deassert CS after data of part
+
+// part of SPI transaction
+struct spi_xfer {
+	const uint8_t *tx;  // 0xff is sent if NULL
+	uint8_t *rx;        // received data is dropped if NULL
+	unsigned len;
+	uint32_t flags;     // SPI_CS_ASSERT, SPI_CS_DEASSERT
+};
+
 enum spi_width {
 	SINGLE,
 	DUAL,
 };
 
-bool spi_set_speed(struct usb_device *device, bool double_speed);
+bool spi_set_speed(struct usb_device *device, unsigned speed, bool double_speed);
 bool spi_cs(struct usb_device *device, bool cs_assert);
 bool spi_transfer_nocs(struct usb_device *device, uint8_t *data_out, uint8_t *data_in,
 		       unsigned len);
 bool spi_transfer(struct usb_device *device, uint8_t *data_out, uint8_t *data_in, unsigned len);
+bool spi_transaction(struct usb_device *device, struct spi_xfer *xfers, int count);
 
 #endif
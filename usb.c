@@ -1,26 +1,302 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <libusb-1.0/libusb.h>
 
 #include "usb.h"
 
+#define USB_VID		0x1a86
+#define USB_PID		0x5512
 
-bool usb_open(struct usb_device *device)
+#define USB_EP_OUT	0x2
+#define USB_EP_IN	0x82
+#define USB_TIMEOUT	1000
+
+// state of one usb_stream() call shared with completion callbacks
+struct usb_stream_state {
+	uint8_t *buf_in;
+	int len_in;
+	int done_in;       // bytes received, they are placed from start of buf_in
+	int requested_in;  // bytes requested by IN transfers in flight
+	int out_in_flight;
+	int in_in_flight;
+	bool failed;
+};
+
+static void usb_free_transfers(struct usb_device *device)
+{
+	if (!device->transfers)
+		return;
+
+	for (int i = 0; i < device->queue_depth * 2; i++)
+		libusb_free_transfer((struct libusb_transfer *)device->transfers[i]);
+
+	free(device->transfers);
+	device->transfers = NULL;
+}
+
+static bool usb_alloc_transfers(struct usb_device *device)
+{
+	if (!device->queue_depth)
+		device->queue_depth = USB_QUEUE_DEPTH_DEFAULT;
+
+	device->transfers = (void **)calloc(device->queue_depth * 2, sizeof(void *));
+	if (!device->transfers)
+		return false;
+
+	for (int i = 0; i < device->queue_depth * 2; i++) {
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+
+		device->transfers[i] = transfer;
+		if (!transfer) {
+			usb_free_transfers(device);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* usbfs maps this memory to device, so data of transfers is not copied by kernel.
+ */
+static void *usb_libusb_mem_alloc(struct usb_device *device, size_t len)
+{
+	return libusb_dev_mem_alloc((struct libusb_device_handle *)device->handle, len);
+}
+
+static void usb_libusb_mem_free(struct usb_device *device, void *mem, size_t len)
+{
+	libusb_dev_mem_free((struct libusb_device_handle *)device->handle, (unsigned char *)mem,
+			    len);
+}
+
+static void usb_libusb_close(struct usb_device *device)
+{
+	struct libusb_device_handle *handle;
+
+	handle = (struct libusb_device_handle *)device->handle;
+	usb_free_transfers(device);
+	libusb_release_interface(handle, 0);
+	if (device->driver_attach)
+		libusb_attach_kernel_driver(handle, 0);
+
+	libusb_close(handle);
+	libusb_exit((struct libusb_context *)device->ctx);
+}
+
+/* Write location of device in format "bus-port.port..." (as in /sys/bus/usb/devices) to `path`.
+ */
+static void usb_libusb_get_path(struct libusb_device *dev, char *path)
+{
+	uint8_t ports[7];
+	int count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	int pos;
+
+	pos = snprintf(path, USB_PATH_LEN, "%u", libusb_get_bus_number(dev));
+	for (int i = 0; i < count; i++)
+		pos += snprintf(path + pos, USB_PATH_LEN - pos, "%c%u", i ? '.' : '-', ports[i]);
+}
+
+static bool usb_libusb_is_ch341(struct libusb_device *dev)
+{
+	struct libusb_device_descriptor desc;
+
+	if (libusb_get_device_descriptor(dev, &desc))
+		return false;
+
+	return desc.idVendor == USB_VID && desc.idProduct == USB_PID;
+}
+
+/* Write serial number of device to `serial`. CH341A usually has no serial number, then location
+ * of device is used.
+ */
+static void usb_libusb_get_serial(struct libusb_device_handle *handle, char *serial)
+{
+	struct libusb_device *dev = libusb_get_device(handle);
+	struct libusb_device_descriptor desc;
+
+	if (!libusb_get_device_descriptor(dev, &desc) && desc.iSerialNumber &&
+	    libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, (unsigned char *)serial,
+					       USB_SERIAL_LEN) > 0)
+		return;
+
+	usb_libusb_get_path(dev, serial);
+}
+
+/* Open CH341A located at `path` or first found CH341A if `path` is NULL.
+ */
+static struct libusb_device_handle *usb_libusb_find(struct libusb_context *ctx, const char *path)
+{
+	struct libusb_device_handle *handle = NULL;
+	struct libusb_device **list;
+	char dev_path[USB_PATH_LEN];
+	ssize_t count;
+
+	count = libusb_get_device_list(ctx, &list);
+	if (count < 0)
+		return NULL;
+
+	for (ssize_t i = 0; i < count; i++) {
+		if (!usb_libusb_is_ch341(list[i]))
+			continue;
+
+		if (path) {
+			usb_libusb_get_path(list[i], dev_path);
+			if (strcmp(path, dev_path))
+				continue;
+		}
+		if (!libusb_open(list[i], &handle))
+			break;
+	}
+	libusb_free_device_list(list, 1);
+
+	return handle;
+}
+
+/* Allocate array of locations of all connected CH341A and store pointer to it to `paths`.
+ * Array and every its item must be freed by caller.
+ * Return count of found devices or -1 if failed.
+ */
+int usb_enumerate(char ***paths)
+{
+	struct libusb_context *ctx;
+	struct libusb_device **list;
+	char dev_path[USB_PATH_LEN];
+	ssize_t count;
+	int found = 0;
+
+	if (libusb_init(&ctx) < 0)
+		return -1;
+
+	count = libusb_get_device_list(ctx, &list);
+	if (count < 0) {
+		libusb_exit(ctx);
+		return -1;
+	}
+
+	*paths = (char **)calloc(count + 1, sizeof(char *));
+	if (*paths) {
+		for (ssize_t i = 0; i < count; i++) {
+			if (!usb_libusb_is_ch341(list[i]))
+				continue;
+
+			usb_libusb_get_path(list[i], dev_path);
+			(*paths)[found++] = strdup(dev_path);
+		}
+	} else
+		found = -1;
+
+	libusb_free_device_list(list, 1);
+	libusb_exit(ctx);
+
+	return found;
+}
+
+static int LIBUSB_CALL usb_monitor_callback(struct libusb_context *ctx, struct libusb_device *dev,
+					    libusb_hotplug_event event, void *user_data)
+{
+	struct usb_monitor *monitor = (struct usb_monitor *)user_data;
+
+	// device can not be opened from callback, so event is queued for usb_monitor_wait()
+	if (monitor->count < USB_MONITOR_QUEUE) {
+		monitor->queue[monitor->count].event = event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ?
+						       USB_EVENT_ARRIVED : USB_EVENT_LEFT;
+		usb_libusb_get_path(dev, monitor->queue[monitor->count].path);
+		monitor->count++;
+	}
+
+	return 0;
+}
+
+/* Start to monitor connect and disconnect of CH341A. Already connected devices are reported as
+ * connected by first calls of usb_monitor_wait().
+ */
+bool usb_monitor_open(struct usb_monitor *monitor)
+{
+	struct libusb_context *ctx;
+	libusb_hotplug_callback_handle handle;
+
+	memset(monitor, 0, sizeof(*monitor));
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return false;
+
+	if (libusb_init(&ctx) < 0)
+		return false;
+
+	if (libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+					     LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					     LIBUSB_HOTPLUG_ENUMERATE, USB_VID, USB_PID,
+					     LIBUSB_HOTPLUG_MATCH_ANY, usb_monitor_callback, monitor,
+					     &handle)) {
+		libusb_exit(ctx);
+		return false;
+	}
+	monitor->ctx = ctx;
+	monitor->handle = handle;
+
+	return true;
+}
+
+void usb_monitor_close(struct usb_monitor *monitor)
+{
+	struct libusb_context *ctx = (struct libusb_context *)monitor->ctx;
+
+	if (!ctx)
+		return;
+
+	libusb_hotplug_deregister_callback(ctx, monitor->handle);
+	libusb_exit(ctx);
+	monitor->ctx = NULL;
+}
+
+/* Wait up to `timeout_ms` for connect or disconnect of CH341A. `event` is USB_EVENT_NONE if
+ * nothing happened, else location of device is written to `path`.
+ */
+bool usb_monitor_wait(struct usb_monitor *monitor, int timeout_ms, enum usb_event *event,
+		      char *path)
+{
+	struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = timeout_ms % 1000 * 1000 };
+
+	if (!monitor->count &&
+	    libusb_handle_events_timeout_completed((struct libusb_context *)monitor->ctx, &tv,
+						   NULL) < 0)
+		return false;
+
+	*event = USB_EVENT_NONE;
+	if (monitor->count) {
+		*event = monitor->queue[0].event;
+		strcpy(path, monitor->queue[0].path);
+		monitor->count--;
+		memmove(&monitor->queue[0], &monitor->queue[1],
+			monitor->count * sizeof(monitor->queue[0]));
+	}
+
+	return true;
+}
+
+static bool usb_libusb_open(struct usb_device *device)
 {
+	struct libusb_context *ctx;
 	struct libusb_device_handle *handle;
 
-	if (!device || libusb_init(NULL) < 0)
+	// every device has own context, so devices can be served from different threads
+	if (libusb_init(&ctx) < 0)
 		return false;
 
-	handle = libusb_open_device_with_vid_pid(NULL, 0x1a86, 0x5512);
-	if (!handle)
+	handle = usb_libusb_find(ctx, device->path);
+	if (!handle) {
+		libusb_exit(ctx);
 		return false;
+	}
 
 	if (libusb_kernel_driver_active(handle, 0)) {
 		device->driver_attach = true;
 		if (libusb_detach_kernel_driver(handle, 0)) {
 			libusb_close(handle);
+			libusb_exit(ctx);
 			return false;
 		}
 	} else
@@ -31,54 +307,303 @@ bool usb_open(struct usb_device *device)
 			libusb_attach_kernel_driver(handle, 0);
 
 		libusb_close(handle);
+		libusb_exit(ctx);
+		return false;
 	}
+	device->ctx = ctx;
 	device->handle = handle;
+	device->transfers = NULL;
+	usb_libusb_get_serial(handle, device->serial);
+	if (!usb_alloc_transfers(device)) {
+		usb_libusb_close(device);
+		return false;
+	}
 
 	return true;
 }
 
-void usb_close(struct usb_device *device)
+/* Read exactly `len` bytes. Device can split data to several short packets, so read until all
+ * data is received.
+ */
+static bool usb_libusb_read(struct usb_device *device, void *buf, int len)
 {
 	struct libusb_device_handle *handle;
-
-	if (!device)
-		return;
+	int transfered;
+	int pos = 0;
+	int ret;
 
 	handle = (struct libusb_device_handle *)device->handle;
-	libusb_release_interface(handle, 0);
-	if (device->driver_attach)
-		libusb_attach_kernel_driver(handle, 0);
+	while (pos < len) {
+		ret = libusb_bulk_transfer(handle, USB_EP_IN, (unsigned char *)buf + pos, len - pos,
+					   &transfered, USB_TIMEOUT);
+		if (ret < 0 && (ret != LIBUSB_ERROR_TIMEOUT || !transfered))
+			return false;
 
-	libusb_close(handle);
-	libusb_exit(NULL);
+		pos += transfered;
+	}
+
+	return true;
 }
 
-bool usb_read(struct usb_device *device, void *buf, int len)
+/* Write `len` bytes. If transfer is interrupted by timeout, then continue from first byte that
+ * was not accepted by device.
+ */
+static bool usb_libusb_write(struct usb_device *device, void *buf, int len)
 {
 	struct libusb_device_handle *handle;
 	int transfered;
+	int pos = 0;
 	int ret;
 
-	if (!device)
-		return false;
-
 	handle = (struct libusb_device_handle *)device->handle;
-	ret = libusb_bulk_transfer(handle, 0x82, (unsigned char *)buf, len, &transfered, 1000);
+	while (pos < len) {
+		ret = libusb_bulk_transfer(handle, USB_EP_OUT, (unsigned char *)buf + pos, len - pos,
+					   &transfered, USB_TIMEOUT);
+		if (ret < 0 && (ret != LIBUSB_ERROR_TIMEOUT || !transfered))
+			return false;
 
-	return ret >= 0;
+		pos += transfered;
+	}
+
+	return true;
 }
 
-bool usb_write(struct usb_device *device, void *buf, int len)
+static void LIBUSB_CALL usb_stream_complete(struct libusb_transfer *transfer)
+{
+	struct usb_stream_state *state = (struct usb_stream_state *)transfer->user_data;
+
+	if (transfer->endpoint == USB_EP_IN) {
+		/* Every IN transfer receives one packet right to its place in buffer. Transfers
+		 * complete in order of submission, so after short packet data of next packets is
+		 * moved back to the end of received data, and missing bytes are requested later.
+		 */
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED || !transfer->actual_length) {
+			state->failed = true;
+		} else {
+			if (transfer->buffer != state->buf_in + state->done_in)
+				memmove(state->buf_in + state->done_in, transfer->buffer,
+					transfer->actual_length);
+			state->done_in += transfer->actual_length;
+		}
+		state->requested_in -= transfer->length;
+		state->in_in_flight--;
+	} else {
+		// OUT data can not be resent out of order, so short OUT transfer is an error
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+		    transfer->actual_length != transfer->length)
+			state->failed = true;
+
+		state->out_in_flight--;
+	}
+
+	// mark transfer as free for next submit
+	transfer->user_data = NULL;
+}
+
+/* Find free transfer in range [first, first + count) of preallocated transfers.
+ */
+static struct libusb_transfer *usb_stream_get_free(struct usb_device *device, int first, int count)
+{
+	struct libusb_transfer *transfer;
+
+	for (int i = first; i < first + count; i++) {
+		transfer = (struct libusb_transfer *)device->transfers[i];
+		if (!transfer->user_data)
+			return transfer;
+	}
+
+	return NULL;
+}
+
+/* Send `count_out` transfers, lengths of transfers are in `lens_out` and their data follows one
+ * by one in `buf_out`. Device answers by `count_in` packets, lengths of packets are in `lens_in`
+ * and they are received one by one to `buf_in` without copy. Up to device->queue_depth OUT and
+ * the same count of IN transfers are kept in flight, so device does not wait for host between
+ * packets.
+ * One OUT transfer can carry many packets, but only the last packet of transfer can be short.
+ * CH341A answers every SPI stream command by one packet, so one IN transfer is submitted for
+ * every expected packet. If device splits packet, the rest of data is requested by additional
+ * transfers after all expected packets.
+ * Return true if all data was sent and received.
+ */
+static bool usb_libusb_stream(struct usb_device *device, uint8_t *buf_out, const int *lens_out,
+			      int count_out, uint8_t *buf_in, const int *lens_in, int count_in)
 {
+	struct libusb_context *ctx = (struct libusb_context *)device->ctx;
 	struct libusb_device_handle *handle;
-	int transfered;
-	int ret;
+	struct libusb_transfer *transfer;
+	struct usb_stream_state state = { 0 };
+	struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+	int depth;
+	int idx_out = 0;
+	int idx_in = 0;
+	int pos_in = 0;  // place in buf_in for next IN transfer
 
-	if (!device)
+	if (!device->transfers)
 		return false;
 
+	state.buf_in = buf_in;
+	for (int i = 0; i < count_in; i++)
+		state.len_in += lens_in[i];
+
 	handle = (struct libusb_device_handle *)device->handle;
-	ret = libusb_bulk_transfer(handle, 0x2, (unsigned char *)buf, len, &transfered, 1000);
+	depth = device->queue_depth;
+	while (!state.failed && (idx_out < count_out || state.done_in < state.len_in ||
+				 state.out_in_flight || state.in_in_flight)) {
+		while (idx_out < count_out && state.out_in_flight < depth) {
+			transfer = usb_stream_get_free(device, 0, depth);
+			libusb_fill_bulk_transfer(transfer, handle, USB_EP_OUT, buf_out,
+						  lens_out[idx_out], usb_stream_complete, &state,
+						  USB_TIMEOUT);
+			if (libusb_submit_transfer(transfer)) {
+				transfer->user_data = NULL;
+				state.failed = true;
+				break;
+			}
+			state.out_in_flight++;
+			buf_out += lens_out[idx_out++];
+		}
+		// all received data is moved to its place when there are no transfers in flight
+		if (!state.in_in_flight)
+			pos_in = state.done_in;
+		while (!state.failed && state.in_in_flight < depth && pos_in < state.len_in &&
+		       state.done_in + state.requested_in < state.len_in) {
+			int len = state.len_in - state.done_in - state.requested_in;
+
+			if (idx_in < count_in)
+				len = lens_in[idx_in++];
+
+			transfer = usb_stream_get_free(device, depth, depth);
+			libusb_fill_bulk_transfer(transfer, handle, USB_EP_IN, buf_in + pos_in, len,
+						  usb_stream_complete, &state, USB_TIMEOUT);
+			if (libusb_submit_transfer(transfer)) {
+				transfer->user_data = NULL;
+				state.failed = true;
+				break;
+			}
+			state.in_in_flight++;
+			state.requested_in += len;
+			pos_in += len;
+		}
+		if (state.failed)
+			break;
+
+		if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+			state.failed = true;
+	}
+
+	if (state.failed) {
+		// cancel all transfers that still in flight and wait for their callbacks
+		for (int i = 0; i < depth * 2; i++) {
+			transfer = (struct libusb_transfer *)device->transfers[i];
+			if (transfer->user_data)
+				libusb_cancel_transfer(transfer);
+		}
+		while (state.out_in_flight || state.in_in_flight) {
+			if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+				break;
+		}
+		return false;
+	}
+
+	return true;
+}
+
+const struct usb_ops usb_libusb_ops = {
+	.open = usb_libusb_open,
+	.close = usb_libusb_close,
+	.read = usb_libusb_read,
+	.write = usb_libusb_write,
+	.stream = usb_libusb_stream,
+	.mem_alloc = usb_libusb_mem_alloc,
+	.mem_free = usb_libusb_mem_free,
+};
+
+bool usb_open(struct usb_device *device)
+{
+	if (!device)
+		return false;
+
+	if (!device->ops)
+		device->ops = &usb_libusb_ops;
+
+	return device->ops->open(device);
+}
+
+static void usb_buf_free(struct usb_device *device, struct usb_buffer *buf)
+{
+	if (buf->dma)
+		device->ops->mem_free(device, buf->data, buf->len);
+	else
+		free(buf->data);
+
+	memset(buf, 0, sizeof(*buf));
+}
+
+void usb_close(struct usb_device *device)
+{
+	if (!device || !device->ops)
+		return;
+
+	for (int i = 0; i < USB_BUF_COUNT; i++)
+		usb_buf_free(device, &device->bufs[i]);
+
+	device->ops->close(device);
+}
+
+/* Return buffer `id` of device with at least `len` bytes. Buffer is allocated by first request
+ * and kept until usb_close(), it is reallocated only if longer buffer is requested (data is lost
+ * then). So hot paths get their buffers without allocation. Memory is DMA capable if backend
+ * supports it.
+ * Return NULL if failed to allocate memory.
+ */
+uint8_t *usb_buf(struct usb_device *device, enum usb_buf id, size_t len)
+{
+	struct usb_buffer *buf;
+
+	if (!device || !device->ops || id >= USB_BUF_COUNT)
+		return NULL;
+
+	buf = &device->bufs[id];
+	if (buf->data && buf->len >= len)
+		return buf->data;
+
+	usb_buf_free(device, buf);
+	if (device->ops->mem_alloc) {
+		buf->data = (uint8_t *)device->ops->mem_alloc(device, len);
+		buf->dma = buf->data != NULL;
+	}
+	// usbfs of old kernels can not map memory
+	if (!buf->data)
+		buf->data = (uint8_t *)malloc(len);
+	if (buf->data)
+		buf->len = len;
+
+	return buf->data;
+}
+
+bool usb_read(struct usb_device *device, void *buf, int len)
+{
+	if (!device || !device->ops)
+		return false;
+
+	return device->ops->read(device, buf, len);
+}
+
+bool usb_write(struct usb_device *device, void *buf, int len)
+{
+	if (!device || !device->ops)
+		return false;
+
+	return device->ops->write(device, buf, len);
+}
+
+bool usb_stream(struct usb_device *device, uint8_t *buf_out, const int *lens_out, int count_out,
+		uint8_t *buf_in, const int *lens_in, int count_in)
+{
+	if (!device || !device->ops)
+		return false;
 
-	return ret >= 0;
+	return device->ops->stream(device, buf_out, lens_out, count_out, buf_in, lens_in,
+				   count_in);
 }
@@ -2,20 +2,98 @@
 #define _USB_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "common.h"
 
+#define USB_QUEUE_DEPTH_DEFAULT 32
+#define USB_PATH_LEN            32  // enough for "bus-port.port.port.port.port.port.port"
+#define USB_SERIAL_LEN          64
+
+struct usb_device;
+
+// transport backend
+struct usb_ops {
+	bool (*open)(struct usb_device *device);
+	void (*close)(struct usb_device *device);
+	bool (*read)(struct usb_device *device, void *buf, int len);
+	bool (*write)(struct usb_device *device, void *buf, int len);
+	bool (*stream)(struct usb_device *device, uint8_t *buf_out, const int *lens_out,
+		       int count_out, uint8_t *buf_in, const int *lens_in, int count_in);
+	// optional, memory for transfers that does not need copy by kernel
+	void *(*mem_alloc)(struct usb_device *device, size_t len);
+	void (*mem_free)(struct usb_device *device, void *mem, size_t len);
+};
+
+// buffers of device borrowed by SPI and SPI NOR layers, see usb_buf()
+enum usb_buf {
+	USB_BUF_OUT,   // commands of usb_stream()
+	USB_BUF_IN,    // received data of usb_stream()
+	USB_BUF_DATA,  // data of flash read to file or written from file
+	USB_BUF_PRE,   // data kept before erased region
+	USB_BUF_POST,  // data kept after erased region
+	USB_BUF_CHECK, // data read to check if region is blank before erase
+	USB_BUF_BLOCK, // current content of erase block programmed with spi_flash.delta
+	USB_BUF_VERIFY, // data read back by spi_flash.verify
+	USB_BUF_DELTA, // data of flash compared with file by --delta
+	USB_BUF_COUNT,
+};
+
+struct usb_buffer {
+	uint8_t *data;
+	size_t len;
+	bool dma;  // allocated by usb_ops.mem_alloc
+};
+
 struct usb_device {
+	const struct usb_ops *ops;  // libusb backend is used if NULL
+	const char *path;           // backend specific device location, first device if NULL
+	void *priv;                 // backend private data
+	char serial[USB_SERIAL_LEN];  // serial number of converter or its location if it is absent
 	uint16_t vid;
 	uint16_t pid;
+	void *ctx;                  // libusb context owned by this device
 	void *handle;
 	bool driver_attach;
+	uint8_t cs;            // chip select line used by spi_cs()
+	unsigned queue_depth;  // count of OUT and count of IN transfers in flight for usb_stream()
+	void **transfers;      // 2 * queue_depth preallocated transfers: OUT first, then IN
+	struct usb_buffer bufs[USB_BUF_COUNT];
+};
+
+#define USB_MONITOR_QUEUE 16
+
+enum usb_event {
+	USB_EVENT_NONE,
+	USB_EVENT_ARRIVED,
+	USB_EVENT_LEFT,
 };
 
+// notifications about connected and disconnected CH341A (libusb hotplug)
+struct usb_monitor {
+	void *ctx;
+	int handle;  // hotplug callback handle
+	int count;   // count of events in queue
+	struct {
+		enum usb_event event;
+		char path[USB_PATH_LEN];
+	} queue[USB_MONITOR_QUEUE];
+};
+
+extern const struct usb_ops usb_libusb_ops;
+
+int usb_enumerate(char ***paths);
+bool usb_monitor_open(struct usb_monitor *monitor);
+void usb_monitor_close(struct usb_monitor *monitor);
+bool usb_monitor_wait(struct usb_monitor *monitor, int timeout_ms, enum usb_event *event,
+		      char *path);
 bool usb_open(struct usb_device *device);
 void usb_close(struct usb_device *device);
 bool usb_read(struct usb_device *device, void *buf, int len);
 bool usb_write(struct usb_device *device, void *buf, int len);
+bool usb_stream(struct usb_device *device, uint8_t *buf_out, const int *lens_out, int count_out,
+		uint8_t *buf_in, const int *lens_in, int count_in);
+uint8_t *usb_buf(struct usb_device *device, enum usb_buf id, size_t len);
 
 #endif
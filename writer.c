@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "writer.h"
+
+#define WRITER_WINDOW		(4 * MiB)  // mapped part of output file
+
+
+static void writer_wait(sem_t *sem)
+{
+	while (sem_wait(sem) && errno == EINTR)
+		;
+}
+
+static bool writer_write(int fd, uint8_t *data, uint32_t len)
+{
+	while (len) {
+		ssize_t res = write(fd, data, len);
+
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return false;
+
+		data += res;
+		len -= res;
+	}
+
+	return true;
+}
+
+/* Thread of WRITER_WRITE mode. Data of pipe is copied by write(): pages passed by vmsplice()
+ * can be moved on by reader of pipe to other pipe, so memory of slot can not be reused safely.
+ */
+static void *writer_run(void *arg)
+{
+	struct writer *writer = (struct writer *)arg;
+
+	while (1) {
+		uint32_t len;
+
+		writer_wait(&writer->filled);
+		len = writer->lens[writer->head];
+		if (!len)
+			break;
+
+		// after error slots are still released, so producer is never blocked
+		if (!atomic_load(&writer->error) &&
+		    !writer_write(writer->fd, writer->mem + writer->head * writer->slot_len, len))
+			atomic_store(&writer->error, errno ? errno : EIO);
+
+		writer->head = (writer->head + 1) % writer->count;
+		sem_post(&writer->free);
+	}
+
+	return NULL;
+}
+
+/* Preallocate `size` bytes from current position of regular file. Mapping needs file opened
+ * for reading and writing.
+ */
+static bool writer_mmap_allowed(struct writer *writer, uint32_t size)
+{
+	int flags = fcntl(writer->fd, F_GETFL);
+	struct stat stat;
+
+	if (!size || flags == -1 || (flags & O_ACCMODE) != O_RDWR)
+		return false;
+
+	writer->pos = lseek(writer->fd, 0, SEEK_CUR);
+	if (writer->pos == (off_t)-1 || fstat(writer->fd, &stat))
+		return false;
+
+	writer->orig_size = stat.st_size;
+	writer->end = writer->pos + size;
+	if (writer->end <= writer->orig_size)
+		return true;
+
+	// file system without preallocation gets sparse file
+	return !fallocate(writer->fd, 0, writer->pos, size) || !ftruncate(writer->fd, writer->end);
+}
+
+/* Prepare output of `size` bytes to `fd` from its current position.
+ */
+bool writer_open(struct writer *writer, int fd, uint32_t size)
+{
+	struct stat stat;
+
+	memset(writer, 0, sizeof(*writer));
+	writer->fd = fd;
+	writer->slot_len = WRITER_SLOT;
+	writer->count = WRITER_SLOTS;
+	atomic_init(&writer->error, 0);
+	if (!fstat(fd, &stat) && S_ISREG(stat.st_mode) && writer_mmap_allowed(writer, size)) {
+		writer->mode = WRITER_MMAP;
+		return true;
+	}
+	// larger pipe than default moves more data by one wakeup of reader
+	if (!fstat(fd, &stat) && S_ISFIFO(stat.st_mode))
+		fcntl(fd, F_SETPIPE_SZ, writer->slot_len);
+
+	writer->mem = (uint8_t *)mmap(NULL, WRITER_SLOT * WRITER_SLOTS, PROT_READ | PROT_WRITE,
+				      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (writer->mem == MAP_FAILED)
+		return false;
+	if (!sem_init(&writer->filled, 0, 0)) {
+		if (!sem_init(&writer->free, 0, writer->count - 1)) {
+			errno = pthread_create(&writer->thread, NULL, writer_run, writer);
+			if (!errno)
+				return true;
+
+			sem_destroy(&writer->free);
+		}
+		sem_destroy(&writer->filled);
+	}
+	munmap(writer->mem, WRITER_SLOT * WRITER_SLOTS);
+
+	return false;
+}
+
+/* Unmap current window and start its writeback. Writeback of previous window is waited and its
+ * pages are dropped from page cache, so dump of large chip does not push out other files.
+ */
+static void writer_unmap(struct writer *writer)
+{
+	off_t end = writer->map_start + writer->map_len;
+
+	if (!writer->map)
+		return;
+
+	munmap(writer->map, writer->map_len);
+	writer->map = NULL;
+	if (end > writer->pos)
+		end = writer->pos;
+
+	if (writer->prev_end > writer->prev_start) {
+		sync_file_range(writer->fd, writer->prev_start, writer->prev_end - writer->prev_start,
+				SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(writer->fd, writer->prev_start, writer->prev_end - writer->prev_start,
+			      POSIX_FADV_DONTNEED);
+	}
+	sync_file_range(writer->fd, writer->map_start, end - writer->map_start,
+			SYNC_FILE_RANGE_WRITE);
+	writer->prev_start = writer->map_start;
+	writer->prev_end = end;
+}
+
+static bool writer_map(struct writer *writer, uint32_t len)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	size_t map_len = max(len, WRITER_WINDOW);
+
+	writer_unmap(writer);
+	writer->map_start = writer->pos & ~(off_t)(page - 1);
+	map_len += writer->pos - writer->map_start;
+	writer->map = (uint8_t *)mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, writer->fd,
+				      writer->map_start);
+	if (writer->map == MAP_FAILED) {
+		writer->map = NULL;
+		return false;
+	}
+	writer->map_len = map_len;
+
+	return true;
+}
+
+static uint8_t *writer_get_mmap(struct writer *writer, uint32_t len)
+{
+	uint8_t *data;
+
+	if (writer->pos + len > writer->end) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((!writer->map || writer->pos + len > writer->map_start + writer->map_len) &&
+	    !writer_map(writer, len))
+		return NULL;
+
+	data = writer->map + (writer->pos - writer->map_start);
+	writer->pos += len;
+	writer->last = len;
+
+	return data;
+}
+
+// pass slot `tail` with `len` bytes to thread and wait for the next free slot
+static void writer_push(struct writer *writer, uint32_t len)
+{
+	writer->lens[writer->tail] = len;
+	writer->tail = (writer->tail + 1) % writer->count;
+	writer->fill = 0;
+	sem_post(&writer->filled);
+	if (len)
+		writer_wait(&writer->free);
+}
+
+/* Return space for `len` bytes (not more than WRITER_SLOT) to be written after previous data. Space is
+ * written to file after next call or by writer_close().
+ * Return NULL if previous write failed, errno is set.
+ */
+uint8_t *writer_get(struct writer *writer, uint32_t len)
+{
+	uint8_t *data;
+	int error;
+
+	if (len > writer->slot_len) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (writer->mode == WRITER_MMAP)
+		return writer_get_mmap(writer, len);
+
+	if (writer->fill + len > writer->slot_len)
+		writer_push(writer, writer->fill);
+
+	error = atomic_load(&writer->error);
+	if (error) {
+		errno = error;
+		return NULL;
+	}
+
+	data = writer->mem + writer->tail * writer->slot_len + writer->fill;
+	writer->fill += len;
+
+	return data;
+}
+
+/* Wait until all data given by writer_get() is written to file and make it durable. Mapped
+ * windows stay as they are, so writeback of file goes on in the background.
+ * Return false if any write failed, errno is set.
+ */
+bool writer_sync(struct writer *writer)
+{
+	struct stat stat;
+	int error;
+
+	if (writer->mode != WRITER_MMAP) {
+		if (writer->fill)
+			writer_push(writer, writer->fill);
+		// all slots are free when thread has written them
+		for (unsigned i = 0; i < writer->count - 1; i++)
+			writer_wait(&writer->free);
+		for (unsigned i = 0; i < writer->count - 1; i++)
+			sem_post(&writer->free);
+	}
+
+	error = atomic_load(&writer->error);
+	if (error) {
+		errno = error;
+		return false;
+	}
+
+	// pipe or device has nothing to sync
+	if (fstat(writer->fd, &stat) || !S_ISREG(stat.st_mode))
+		return true;
+
+	return !fdatasync(writer->fd);
+}
+
+// data of mapped file is already in it, file position is set after it as by write()
+static bool writer_close_mmap(struct writer *writer, bool flush)
+{
+	bool res = true;
+
+	if (!flush)
+		writer->pos -= writer->last;
+	writer_unmap(writer);
+
+	// preallocated but not written part is removed
+	if (writer->pos < writer->end && writer->end > writer->orig_size)
+		res = !ftruncate(writer->fd, max(writer->pos, writer->orig_size));
+
+	return lseek(writer->fd, writer->pos, SEEK_SET) != (off_t)-1 && res;
+}
+
+/* Finish output. With `flush` data of last writer_get() is written, else it is dropped.
+ * Return false if any write failed, errno is set.
+ */
+bool writer_close(struct writer *writer, bool flush)
+{
+	int error;
+
+	if (writer->mode == WRITER_MMAP)
+		return writer_close_mmap(writer, flush);
+
+	if (flush && writer->fill)
+		writer_push(writer, writer->fill);
+	writer_push(writer, 0);
+	pthread_join(writer->thread, NULL);
+	sem_destroy(&writer->filled);
+	sem_destroy(&writer->free);
+	munmap(writer->mem, WRITER_SLOT * WRITER_SLOTS);
+
+	error = atomic_load(&writer->error);
+	if (error)
+		errno = error;
+
+	return !error;
+}
@@ -0,0 +1,59 @@
+#ifndef _WRITER_H
+#define _WRITER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+#define WRITER_SLOT	(256 * KiB)  // data is passed to thread by such parts
+#define WRITER_SLOTS	8            // memory of output is bounded by this count of slots
+
+enum writer_mode {
+	WRITER_WRITE,   // slots are written by thread
+	WRITER_MMAP,    // data is put directly to mapped window of file, thread is not used
+};
+
+/*
+ * Output of data to file. Regular file opened for reading and writing is preallocated and
+ * mapped by windows, producer puts data directly to file pages. For other files producer fills
+ * ring of slots and separate thread writes them, so slow output (disk, NFS, pipe) does not stall
+ * producer until whole ring is filled. Ring has one producer and one consumer, every slot is
+ * owned by one of them, semaphores only count filled and free slots.
+ */
+struct writer {
+	enum writer_mode mode;
+	int fd;
+	uint8_t *mem;            // `count` slots of `slot_len` bytes
+	uint32_t slot_len;
+	unsigned count;
+	uint32_t lens[WRITER_SLOTS];  // data in slot, 0 marks end of data
+	unsigned head;           // next slot to write by thread
+	unsigned tail;           // slot filled by producer
+	uint32_t fill;           // bytes in slot `tail`
+	sem_t filled;
+	sem_t free;
+	atomic_int error;        // errno of failed write, later data is dropped
+	pthread_t thread;
+	// WRITER_MMAP
+	off_t pos;               // file position of next data
+	off_t end;               // end of preallocated region
+	off_t orig_size;         // size of file before preallocation
+	uint32_t last;           // length of last writer_get()
+	uint8_t *map;
+	off_t map_start;
+	size_t map_len;
+	off_t prev_start;        // previous window, its writeback was started
+	off_t prev_end;
+};
+
+bool writer_open(struct writer *writer, int fd, uint32_t size);
+uint8_t *writer_get(struct writer *writer, uint32_t len);
+bool writer_sync(struct writer *writer);
+bool writer_close(struct writer *writer, bool flush);
+
+#endif